@@ -0,0 +1,400 @@
+/**
+ * @file cache.cpp
+ * @brief Persistent cache of cost volume and checkpoints of algorithm
+ * @author Pascal Monasse <monasse@imagine.enpc.fr>
+ *
+ * Copyright (c) 2017, Pascal Monasse
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * You should have received a copy of the GNU General Pulic License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+The cost volume can be stored in a cache file, whose name is derived from a
+hash of both images, the disparity range and the data cost type. The file is
+a header followed by the raw cost volume, so that it can be memory mapped as
+is by later runs on the same pair, even with different K or lambda.
+
+A checkpoint file stores the state of a run (see Match::run) on the same
+pair with the same parameters, to resume it after the process is killed.
+*/
+
+#include "match.h"
+#include "progress.h"
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <sstream>
+#include <iomanip>
+#ifndef _WIN32
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#else
+#include <process.h>
+#define getpid _getpid
+#endif
+
+/// Identifier of cache files, to be changed when data costs are modified.
+static const char CACHE_MAGIC[8] = {'K','Z','2','C','V','0','0','1'};
+
+/// Header of cache file, followed by the cost volume. The hash of images is
+/// in the file name.
+struct CacheHeader {
+    char magic[8];
+    int width, height; ///< Dimensions of left image
+    int dispMin, dispMax; ///< Disparity range
+    int dataCost; ///< Type of data cost
+    int reserved; ///< Padding, always 0
+};
+
+/// FNV-1a hash of n bytes, continuing from hash h.
+static unsigned long long fnv1a(const unsigned char* data, size_t n,
+                                unsigned long long h) {
+    for(size_t i=0; i<n; i++) {
+        h ^= data[i];
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+/// Name of temporary file to write before renaming it to \a fileName. The
+/// pid makes it distinct for concurrent processes writing the same file.
+static std::string temp_name(const std::string& fileName) {
+    std::ostringstream s;
+    s << fileName << '.' << getpid() << ".tmp";
+    return s.str();
+}
+
+/// Rename complete temporary file \a tmp to \a fileName. On POSIX, rename
+/// replaces an existing file atomically, so that readers see either the old
+/// or the new file. Windows does not replace, so the old file is removed.
+static bool replace_file(const std::string& tmp, const std::string& fileName) {
+#ifdef _WIN32
+    std::remove(fileName.c_str());
+#endif
+    return (std::rename(tmp.c_str(), fileName.c_str())==0);
+}
+
+/// Hash of the rows of rectangle \a size in image im with c bytes per pixel.
+static unsigned long long hash_image(GeneralImage im, Coord size, int c,
+                                     unsigned long long h) {
+    h = fnv1a((const unsigned char*)&size, sizeof(Coord), h);
+    h = fnv1a((const unsigned char*)&c, sizeof(int), h);
+    for(int y=0; y<size.y; y++)
+        h = fnv1a((const unsigned char*)(im+y)->data, size.x*c, h);
+    return h;
+}
+
+/// Set directory where cost volumes are cached (empty string for no cache).
+void Match::SetCacheDir(const std::string& dir) {
+    cacheDir = dir;
+}
+
+/// Header of cache file for the given parameters.
+static CacheHeader make_header(Coord size, int dispMin, int dispMax,
+                               int dataCost) {
+    CacheHeader header;
+    std::memcpy(header.magic, CACHE_MAGIC, sizeof(CACHE_MAGIC));
+    header.width  = size.x;
+    header.height = size.y;
+    header.dispMin = dispMin;
+    header.dispMax = dispMax;
+    header.dataCost = dataCost;
+    header.reserved = 0;
+    return header;
+}
+
+/// Hash of images, disparity range and data cost type.
+static unsigned long long cache_key(GeneralImage L, Coord sizeL,
+                                    GeneralImage R, Coord sizeR, int c,
+                                    int dispMin, int dispMax, int dataCost) {
+    unsigned long long h = 14695981039346656037ULL;
+    h = hash_image(L, sizeL, c, h);
+    h = hash_image(R, sizeR, c, h);
+    int v[3] = {dispMin, dispMax, dataCost};
+    return fnv1a((const unsigned char*)v, sizeof(v), h);
+}
+
+/// Name of cache file of cost volume for current images and parameters.
+std::string Match::CostVolumeCacheFile() const {
+    GeneralImage L = (imLeft? (GeneralImage)imLeft:  (GeneralImage)imColorLeft);
+    GeneralImage R = (imLeft? (GeneralImage)imRight:(GeneralImage)imColorRight);
+    unsigned long long key = cache_key(L, imSizeL, R, imSizeR, imLeft? 1: 3,
+                                       dispMin, dispMax, params.dataCost);
+    std::ostringstream s;
+    s << cacheDir << "/kz2-" << std::hex << std::setfill('0') << std::setw(16)
+      << key << ".cv";
+    return s.str();
+}
+
+/// Map cost volume from cache file. Return whether it succeeded.
+bool Match::LoadCostVolume(const std::string& fileName) {
+    const size_t n = (size_t)imSizeL.x*imSizeL.y*(dispMax-dispMin+1);
+    const size_t size = sizeof(CacheHeader) + n*sizeof(short);
+    CacheHeader expected = make_header(imSizeL, dispMin, dispMax,
+                                       params.dataCost);
+#ifndef _WIN32
+    int fd = open(fileName.c_str(), O_RDONLY);
+    if(fd<0)
+        return false;
+    struct stat st;
+    void* map = MAP_FAILED;
+    if(fstat(fd,&st)==0 && (size_t)st.st_size==size)
+        map = mmap(0, size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if(map==MAP_FAILED)
+        return false;
+    if(std::memcmp(map, &expected, sizeof(CacheHeader)) != 0) {
+        munmap(map, size);
+        return false;
+    }
+    costVolumeMap = map;
+    costVolumeMapSize = size;
+    costVolume = (const short*)((const char*)map + sizeof(CacheHeader));
+#else // No mmap, read file
+    FILE* file = fopen(fileName.c_str(), "rb");
+    if(! file)
+        return false;
+    CacheHeader header;
+    short* volume = 0;
+    if(fread(&header,sizeof(CacheHeader),1,file)==1 &&
+       std::memcmp(&header, &expected, sizeof(CacheHeader))==0) {
+        volume = new short[n];
+        if(fread(volume, sizeof(short), n, file) != n) {
+            delete [] volume;
+            volume = 0;
+        }
+    }
+    fclose(file);
+    if(! volume)
+        return false;
+    costVolume = volume;
+#endif
+    costVolumeType = params.dataCost;
+    if(progress)
+        progress->info("Cost volume read from cache " + fileName);
+    return true;
+}
+
+/// Write cost volume to cache file.
+///
+/// Write first to a temporary file of the process, renamed when complete, so
+/// that other runs never map an incomplete file, even if they write the same
+/// cache file concurrently.
+void Match::SaveCostVolume(const std::string& fileName) const {
+    const size_t n = (size_t)imSizeL.x*imSizeL.y*(dispMax-dispMin+1);
+    CacheHeader header = make_header(imSizeL, dispMin, dispMax,
+                                     params.dataCost);
+    std::string tmp = temp_name(fileName);
+    FILE* file = fopen(tmp.c_str(), "wb");
+    bool ok = (file!=0);
+    if(ok) {
+        ok = (fwrite(&header, sizeof(CacheHeader), 1, file)==1 &&
+              fwrite(costVolume, sizeof(short), n, file)==n);
+        ok = (fclose(file)==0) && ok;
+    }
+    if(ok)
+        ok = replace_file(tmp, fileName);
+    if(! ok) {
+        std::remove(tmp.c_str());
+        std::cerr << "Unable to write cache file " << fileName << std::endl;
+        return;
+    }
+    if(progress)
+        progress->info("Cost volume saved to cache " + fileName);
+}
+
+/// Release memory of cost volume, data costs are then computed on the fly.
+void Match::FreeCostVolume() {
+#ifndef _WIN32
+    if(costVolumeMap)
+        munmap(costVolumeMap, costVolumeMapSize);
+    else
+#endif
+    delete [] costVolume;
+    costVolume = 0;
+    costVolumeType = -1;
+    costVolumeMap = 0;
+    costVolumeMapSize = 0;
+}
+
+/// Identifier of checkpoint files, to be changed when their format is.
+static const char CHECKPOINT_MAGIC[8] = {'K','Z','2','C','P','0','0','2'};
+
+/// Header of checkpoint file. It is followed by the disparity map, stored
+/// as unsigned shorts d-dispMin (0xffff for occlusion), the permutation of
+/// labels, the flags done and occOptimal as bytes and the scores of labels
+/// (for schedules other than RANDOM).
+struct CheckpointHeader {
+    char magic[8];
+    unsigned long long key; ///< Hash of images, disparity range and data cost
+    int width, height; ///< Dimensions of left image
+    int dispMin, dispMax; ///< Disparity range
+    int K, lambda1, lambda2, denominator, edgeThresh; ///< Parameters of energy
+    int schedule; ///< Order of labels
+    int iter, index, step, E, iterE, stop; ///< See Match::Checkpoint
+};
+
+/// Save checkpoints of run to \a file (empty: none), every \a period seconds
+/// during iterations and at the end of each one. If \a resume and \a file is
+/// a checkpoint of the same images and parameters, the disparity map is read
+/// from it and the next run continues from it. Call after SetDispRange and
+/// SetParameters. Return whether a checkpoint was read.
+bool Match::SetCheckpoint(const std::string& file, double period,
+                          bool resume) {
+    checkpointFile = file;
+    checkpointPeriod = period;
+    delete resumed;
+    resumed = 0;
+    const int dispSize = dispMax-dispMin+1;
+    if(!resume || file.empty())
+        return false;
+    FILE* f = fopen(file.c_str(), "rb");
+    if(! f)
+        return false;
+
+    GeneralImage L = (imLeft? (GeneralImage)imLeft:  (GeneralImage)imColorLeft);
+    GeneralImage R = (imLeft? (GeneralImage)imRight:(GeneralImage)imColorRight);
+    CheckpointHeader h;
+    bool ok = (fread(&h, sizeof(CheckpointHeader), 1, f)==1 &&
+               std::memcmp(h.magic, CHECKPOINT_MAGIC, 8)==0 &&
+               h.key==cache_key(L, imSizeL, R, imSizeR, imLeft? 1: 3,
+                                dispMin, dispMax, params.dataCost) &&
+               h.width==imSizeL.x && h.height==imSizeL.y &&
+               h.dispMin==dispMin && h.dispMax==dispMax &&
+               h.K==params.K && h.lambda1==params.lambda1 &&
+               h.lambda2==params.lambda2 &&
+               h.denominator==params.denominator &&
+               h.edgeThresh==params.edgeThresh &&
+               h.schedule==params.schedule);
+    const size_t n = (size_t)imSizeL.x*imSizeL.y;
+    std::vector<unsigned short> disp(ok? n: 0);
+    Checkpoint* state = new Checkpoint;
+    state->permutation.resize(dispSize);
+    state->done.resize(dispSize);
+    state->occOptimal.resize(dispSize);
+    if(params.schedule != Parameters::RANDOM)
+        state->score.resize(dispSize);
+    ok = ok && fread(&disp[0], sizeof(short), n, f)==n &&
+        fread(&state->permutation[0], sizeof(int), dispSize, f)==
+        (size_t)dispSize &&
+        fread(&state->done[0], 1, dispSize, f)==(size_t)dispSize &&
+        fread(&state->occOptimal[0], 1, dispSize, f)==(size_t)dispSize &&
+        (state->score.empty() ||
+         fread(&state->score[0], sizeof(float), dispSize, f)==
+         (size_t)dispSize);
+    fclose(f);
+    if(! ok) {
+        delete state;
+        std::cerr << "Checkpoint " << file << " does not match images and"
+                  << " parameters, ignored" << std::endl;
+        return false;
+    }
+
+    // Check values before they index images and arrays
+    bool valid = (0<=h.index && h.index<=dispSize);
+    for(size_t i=0; valid && i<n; i++) {
+        const Coord p((int)(i%imSizeL.x), (int)(i/imSizeL.x));
+        valid = (disp[i]==0xffff || (disp[i]<dispSize &&
+                                     inRect(p+(dispMin+disp[i]),imSizeR)));
+    }
+    std::vector<bool> seen(dispSize, false); // Labels in permutation
+    for(int i=0; valid && i<dispSize; i++) {
+        const int a = state->permutation[i];
+        valid = (0<=a && a<dispSize && !seen[a]);
+        if(valid)
+            seen[a] = true;
+    }
+    if(! valid) {
+        std::cerr << "Corrupted checkpoint " << file << std::endl;
+        exit(1);
+    }
+
+    for(size_t i=0; i<n; i++)
+        imRef(d_left, i%imSizeL.x, i/imSizeL.x) =
+            (disp[i]==0xffff)? OCCLUDED: dispMin+disp[i];
+    if(ComputeEnergy() != h.E) {
+        std::cerr << "Corrupted checkpoint " << file << std::endl;
+        exit(1);
+    }
+    state->iter = h.iter;
+    state->index = h.index;
+    state->step = h.step;
+    state->iterE = h.iterE;
+    state->stop = (h.stop!=0);
+    resumed = state;
+    return true;
+}
+
+/// Write checkpoint file with the disparity map and the state of run: the
+/// next move is at \a index of \a permutation in iteration \a iter.
+///
+/// As for the cache, a temporary file is renamed when complete, so that a
+/// process killed while writing leaves the previous checkpoint intact.
+void Match::SaveCheckpoint(int iter, int index, int step, int iterE,
+                           bool stop, const int* permutation,
+                           const bool* done, const bool* occOptimal,
+                           const float* score) const {
+    GeneralImage L = (imLeft? (GeneralImage)imLeft:  (GeneralImage)imColorLeft);
+    GeneralImage R = (imLeft? (GeneralImage)imRight:(GeneralImage)imColorRight);
+    CheckpointHeader h;
+    std::memset(&h, 0, sizeof(CheckpointHeader)); // Padding bytes
+    std::memcpy(h.magic, CHECKPOINT_MAGIC, sizeof(CHECKPOINT_MAGIC));
+    h.key = cache_key(L, imSizeL, R, imSizeR, imLeft? 1: 3,
+                      dispMin, dispMax, params.dataCost);
+    h.width = imSizeL.x;
+    h.height = imSizeL.y;
+    h.dispMin = dispMin;
+    h.dispMax = dispMax;
+    h.K = params.K;
+    h.lambda1 = params.lambda1;
+    h.lambda2 = params.lambda2;
+    h.denominator = params.denominator;
+    h.edgeThresh = params.edgeThresh;
+    h.schedule = params.schedule;
+    h.iter = iter;
+    h.index = index;
+    h.step = step;
+    h.E = E;
+    h.iterE = iterE;
+    h.stop = stop? 1: 0;
+
+    const size_t n = (size_t)imSizeL.x*imSizeL.y;
+    const size_t dispSize = dispMax-dispMin+1;
+    std::vector<unsigned short> disp(n);
+    for(size_t i=0; i<n; i++) {
+        int d = imRef(d_left, i%imSizeL.x, i/imSizeL.x);
+        disp[i] = (unsigned short)((d==OCCLUDED)? 0xffff: d-dispMin);
+    }
+    std::vector<unsigned char> flags(done, done+dispSize);
+    flags.insert(flags.end(), occOptimal, occOptimal+dispSize);
+
+    std::string tmp = temp_name(checkpointFile);
+    FILE* file = fopen(tmp.c_str(), "wb");
+    bool ok = (file!=0);
+    if(ok) {
+        ok = (fwrite(&h, sizeof(CheckpointHeader), 1, file)==1 &&
+              fwrite(&disp[0], sizeof(short), n, file)==n &&
+              fwrite(permutation, sizeof(int), dispSize, file)==dispSize &&
+              fwrite(&flags[0], 1, 2*dispSize, file)==2*dispSize &&
+              (!score ||
+               fwrite(score, sizeof(float), dispSize, file)==dispSize));
+        ok = (fclose(file)==0) && ok;
+    }
+    if(ok)
+        ok = replace_file(tmp, checkpointFile);
+    if(! ok) {
+        std::remove(tmp.c_str());
+        std::cerr << "Unable to write checkpoint " << checkpointFile
+                  << std::endl;
+    }
+}
@@ -199,6 +199,15 @@ public:
         assert(false); // Called with non-existent option, probably a bug
         return false;
     }
+    /// Was the option used in last parsing? Query by long name.
+    bool used(const std::string& longName) const {
+        std::vector<Option*>::const_iterator it=opts.begin();
+        for(; it != opts.end(); ++it)
+            if((*it)->longName == longName)
+                return (*it)->used;
+        assert(false); // Called with non-existent option, probably a bug
+        return false;
+    }
 };
 
 #endif
@@ -22,11 +22,19 @@ Functions depending on input images:
 data_penalty_X(Coord p, Coord q)
 smoothness_penalty_X(Coord p1, Coord p2, Coord disp)
 
-where X describes the appropriate case (gray/color)
+where X describes the appropriate case (gray/color/census)
 */
 
 #include "match.h"
 #include <algorithm>
+#include <iostream>
+#include <new>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#if defined(_MSC_VER) && defined(KZ2_POPCNT)
+#include <intrin.h>
+#endif
 
 /************************************************************/
 /********************* data penalty *************************/
@@ -85,86 +93,292 @@ int Match::data_penalty_color(Coord p, Coord q) const {
     return dSum/3;
 }
 
+/// Number of bits set in v, a single instruction if built with KZ2_POPCNT.
+inline int popcount(unsigned int v) {
+#if defined(__GNUC__)
+    return __builtin_popcount(v); // POPCNT only if compiled with -mpopcnt
+#elif defined(_MSC_VER) && defined(KZ2_POPCNT)
+    return __popcnt(v);
+#else
+    v = v - ((v >> 1) & 0x55555555);
+    v = (v & 0x33333333) + ((v >> 2) & 0x33333333);
+    return (((v + (v >> 4)) & 0x0F0F0F0F) * 0x01010101) >> 24;
+#endif
+}
+
+const int Match::CENSUS_RADIUS=2;
+/// Number of bits of census transform (all pixels of window but center)
+static const int CENSUS_BITS=
+    (2*Match::CENSUS_RADIUS+1)*(2*Match::CENSUS_RADIUS+1)-1;
+
+/// Census distance between pixels p and q: Hamming distance of their census
+/// transforms, scaled to the same range [0,CUTOFF] as L1 distance.
+int Match::data_penalty_census(Coord p, Coord q) const {
+    unsigned int bits = IMREF(censusLeft,p) ^ IMREF(censusRight,q);
+    return popcount(bits)*CUTOFF/CENSUS_BITS;
+}
+
+/// Data penalty between pixels p and q, read in the cost volume if available.
+int Match::data_penalty(Coord p, Coord q) const {
+    if(costVolume) {
+        size_t i = (size_t)(q.x-p.x-dispMin)*imSizeL.y + p.y;
+        return costVolume[i*imSizeL.x + p.x];
+    }
+    if(params.dataCost==Parameters::CENSUS)
+        return data_penalty_census(p,q);
+    return (imLeft? data_penalty_gray(p,q): data_penalty_color(p,q));
+}
+
 /************************************************************/
 /******************* Preprocessing for Birchfield-Tomasi ****/
 /************************************************************/
 
-/// Fill ImMin and ImMax from Im (gray version)
-static void SubPixel(GrayImage Im, GrayImage ImMin, GrayImage ImMax) {
-    Coord p;
-    int I, I1, I2, I3, I4, IMin, IMax;
-    int xmax=imGetXSize(ImMin), ymax=imGetYSize(ImMin);
-
-    for (p.y=0; p.y<ymax; p.y++)
-    for (p.x=0; p.x<xmax; p.x++) {
-        I = IMin = IMax = imRef(Im, p.x, p.y);
-        I1 = (p.x>0?      (imRef(Im, p.x-1, p.y) + I) / 2: I);
-        I2 = (p.x+1<xmax? (imRef(Im, p.x+1, p.y) + I) / 2: I);
-        I3 = (p.y>0?      (imRef(Im, p.x, p.y-1) + I) / 2: I);
-        I4 = (p.y+1<ymax? (imRef(Im, p.x, p.y+1) + I) / 2: I);
-
-        if (IMin > I1) IMin = I1;
-        if (IMin > I2) IMin = I2;
-        if (IMin > I3) IMin = I3;
-        if (IMin > I4) IMin = I4;
-        if (IMax < I1) IMax = I1;
-        if (IMax < I2) IMax = I2;
-        if (IMax < I3) IMax = I3;
-        if (IMax < I4) IMax = I4;
-
-        imRef(ImMin, p.x, p.y) = IMin;
-        imRef(ImMax, p.x, p.y) = IMax;
+/// Update the range [IMin,IMax] with the mean of I and its neighbor value J.
+inline void sub_pixel_range(int I, int J, int& IMin, int& IMax) {
+    J = (I+J)/2;
+    if (IMin > J) IMin = J;
+    if (IMax < J) IMax = J;
+}
+
+/// Fill bytes [i0,i1) of rows rowMin and rowMax (scalar version).
+///
+/// Byte i of a row is a channel of a pixel and the same channel of the left and
+/// right neighbor pixels are at indices i-c and i+c. Rows \a up and \a down are
+/// the vertical neighbors (equal to \a row at top and bottom border).
+static void SubPixelBytes(const unsigned char* up, const unsigned char* row,
+                          const unsigned char* down, int n, int c,
+                          int i0, int i1,
+                          unsigned char* rowMin, unsigned char* rowMax) {
+    for(int i=i0; i<i1; i++) {
+        int I=row[i], IMin=I, IMax=I;
+        if(i>=c)  sub_pixel_range(I, row[i-c], IMin, IMax);
+        if(i+c<n) sub_pixel_range(I, row[i+c], IMin, IMax);
+        sub_pixel_range(I, up[i],   IMin, IMax);
+        sub_pixel_range(I, down[i], IMin, IMax);
+        rowMin[i] = (unsigned char)IMin;
+        rowMax[i] = (unsigned char)IMax;
     }
 }
 
-/// Fill ImMin and ImMax from Im (color version)
-static void SubPixelColor(RGBImage Im, RGBImage ImMin, RGBImage ImMax) {
-    int I, I1, I2, I3, I4, IMin, IMax;
-
-    Coord p;
-    int xmax=imGetXSize(ImMin), ymax=imGetYSize(ImMin);
-    for(p.y=0; p.y<ymax; p.y++)
-    for(p.x=0; p.x<xmax; p.x++)
-        for(int i=0; i<3; i++) { // Loop over channels
-            I = IMin = IMax = imRef(Im, p.x, p.y).c[i];
-            I1 = (p.x>0?      (imRef(Im, p.x-1, p.y).c[i] + I) / 2: I);
-            I2 = (p.x+1<xmax? (imRef(Im, p.x+1, p.y).c[i] + I) / 2: I);
-            I3 = (p.y>0?      (imRef(Im, p.x, p.y-1).c[i] + I) / 2: I);
-            I4 = (p.y+1<ymax? (imRef(Im, p.x, p.y+1).c[i] + I) / 2: I);
-
-            if (IMin > I1) IMin = I1;
-            if (IMin > I2) IMin = I2;
-            if (IMin > I3) IMin = I3;
-            if (IMin > I4) IMin = I4;
-            if (IMax < I1) IMax = I1;
-            if (IMax < I2) IMax = I2;
-            if (IMax < I3) IMax = I3;
-            if (IMax < I4) IMax = I4;
-
-            imRef(ImMin, p.x, p.y).c[i] = IMin;
-            imRef(ImMax, p.x, p.y).c[i] = IMax;
-        }
+#ifdef __SSE2__
+/// Mean of bytes rounded down, as (I+J)/2 in scalar version.
+/// _mm_avg_epu8 rounds up, so subtract 1 when the sum is odd.
+inline __m128i avg_floor_epu8(__m128i I, __m128i J) {
+    return _mm_sub_epi8(_mm_avg_epu8(I,J),
+                        _mm_and_si128(_mm_xor_si128(I,J), _mm_set1_epi8(1)));
 }
+#endif
 
-/// Preprocessing for faster Birchfield-Tomasi distance computation.
-void Match::InitSubPixel() {
+/// Fill row y of ImMin and ImMax from Im. Pixels have c channels (1 or 3).
+/// Dimensions are those of ImMin, as Im may be higher.
+///
+/// Left and right border pixels are handled separately, all others are
+/// processed by chunks of 16 bytes when SSE2 is available.
+static void SubPixelRow(GeneralImage Im, GeneralImage ImMin,
+                        GeneralImage ImMax, int c, int y) {
+    const int w=imGetXSize(ImMin), h=imGetYSize(ImMin), n=c*w;
+    typedef const unsigned char* Row;
+    Row row  = (Row)(Im+y)->data;
+    Row up   = (y>0?   (Row)(Im+y-1)->data: row);
+    Row down = (y+1<h? (Row)(Im+y+1)->data: row);
+    unsigned char* rowMin = (unsigned char*)(ImMin+y)->data;
+    unsigned char* rowMax = (unsigned char*)(ImMax+y)->data;
+
+    if(n<=2*c) { // No interior pixel
+        SubPixelBytes(up, row, down, n, c, 0, n, rowMin, rowMax);
+        return;
+    }
+    SubPixelBytes(up, row, down, n, c, 0, c, rowMin, rowMax); // Left border
+    int i=c;
+#ifdef __SSE2__
+    for(; i+16<=n-c; i+=16) {
+        typedef const __m128i* Ptr;
+        __m128i I = _mm_loadu_si128((Ptr)(row+i));
+        __m128i I1= avg_floor_epu8(I, _mm_loadu_si128((Ptr)(row+i-c)));
+        __m128i I2= avg_floor_epu8(I, _mm_loadu_si128((Ptr)(row+i+c)));
+        __m128i I3= avg_floor_epu8(I, _mm_loadu_si128((Ptr)(up+i)));
+        __m128i I4= avg_floor_epu8(I, _mm_loadu_si128((Ptr)(down+i)));
+        __m128i IMin = _mm_min_epu8(_mm_min_epu8(I, I1),
+                                    _mm_min_epu8(_mm_min_epu8(I2,I3), I4));
+        __m128i IMax = _mm_max_epu8(_mm_max_epu8(I, I1),
+                                    _mm_max_epu8(_mm_max_epu8(I2,I3), I4));
+        _mm_storeu_si128((__m128i*)(rowMin+i), IMin);
+        _mm_storeu_si128((__m128i*)(rowMax+i), IMax);
+    }
+#endif
+    SubPixelBytes(up, row, down, n, c, i, n-c, rowMin, rowMax); // Remainder
+    SubPixelBytes(up, row, down, n, c, n-c, n, rowMin, rowMax); // Right border
+}
+
+/// Fill ImMin and ImMax from Im for left and right images.
+///
+/// Rows of both images are processed concurrently (if OpenMP is available).
+static void SubPixel(GeneralImage ImL, GeneralImage ImLMin, GeneralImage ImLMax,
+                     GeneralImage ImR, GeneralImage ImRMin, GeneralImage ImRMax,
+                     int c) {
+    const int hL=imGetYSize(ImLMin), h=hL+imGetYSize(ImRMin);
+#ifdef _OPENMP
+#pragma omp parallel for schedule(static)
+#endif
+    for(int y=0; y<h; y++)
+        if(y<hL) SubPixelRow(ImL, ImLMin, ImLMax, c, y);
+        else     SubPixelRow(ImR, ImRMin, ImRMax, c, y-hL);
+}
+
+/// Preprocessing for faster Birchfield-Tomasi distance computation. Buffers
+/// already allocated are recomputed only if \a update (new images).
+void Match::InitSubPixel(bool update) {
     if(imLeft && !imLeftMin) {
         imLeftMin  = (GrayImage) imNew(IMAGE_GRAY, imSizeL);
         imLeftMax  = (GrayImage) imNew(IMAGE_GRAY, imSizeL);
         imRightMin = (GrayImage) imNew(IMAGE_GRAY, imSizeR);
         imRightMax = (GrayImage) imNew(IMAGE_GRAY, imSizeR);
-
-        SubPixel(imLeft,  imLeftMin,  imLeftMax);
-        SubPixel(imRight, imRightMin, imRightMax);
+        update = true;
     }
+    if(imLeft && update)
+        SubPixel((GeneralImage)imLeft,  (GeneralImage)imLeftMin,
+                 (GeneralImage)imLeftMax,
+                 (GeneralImage)imRight, (GeneralImage)imRightMin,
+                 (GeneralImage)imRightMax, 1);
     if(imColorLeft && !imColorLeftMin) {
         imColorLeftMin  = (RGBImage) imNew(IMAGE_RGB, imSizeL);
         imColorLeftMax  = (RGBImage) imNew(IMAGE_RGB, imSizeL);
         imColorRightMin = (RGBImage) imNew(IMAGE_RGB, imSizeR);
         imColorRightMax = (RGBImage) imNew(IMAGE_RGB, imSizeR);
+        update = true;
+    }
+    if(imColorLeft && update)
+        SubPixel((GeneralImage)imColorLeft,  (GeneralImage)imColorLeftMin,
+                 (GeneralImage)imColorLeftMax,
+                 (GeneralImage)imColorRight, (GeneralImage)imColorRightMin,
+                 (GeneralImage)imColorRightMax, 3);
+}
+
+/************************************************************/
+/******************* Preprocessing for census ***************/
+/************************************************************/
+
+/// Census transform of row y of image Im with c channels (1 or 3).
+///
+/// Bit i is set if the i'th pixel of the window (in raster order, skipping
+/// center) is darker than the center. Intensity is the sum of channels and
+/// pixels outside the image are replaced by the closest one. Only the
+/// rectangle \a size of Im is considered (Im may be higher).
+static void CensusRow(GeneralImage Im, int c, Coord size, int y,
+                      IntImage census) {
+    const unsigned char* row = (const unsigned char*)(Im+y)->data;
+    const int r = Match::CENSUS_RADIUS;
+    for(int x=0; x<size.x; x++) {
+        int I=0;
+        for(int k=0; k<c; k++)
+            I += row[c*x+k];
+        unsigned int bits=0;
+        for(int dy=-r; dy<=r; dy++) {
+            int y2 = std::min(std::max(y+dy,0), size.y-1);
+            const unsigned char* row2=(const unsigned char*)(Im+y2)->data;
+            for(int dx=-r; dx<=r; dx++) {
+                if(dx==0 && dy==0) continue;
+                const unsigned char* v = row2+c*std::min(std::max(x+dx,0),
+                                                         size.x-1);
+                int J=0;
+                for(int k=0; k<c; k++)
+                    J += v[k];
+                bits = (bits<<1) | (J<I? 1: 0);
+            }
+        }
+        imRef(census,x,y) = (int)bits;
+    }
+}
+
+/// Census transform of both images, such that the data cost of a pair of
+/// pixels is the number of different bits. If already computed, it is
+/// recomputed in place only if \a update (new images).
+void Match::InitCensus(bool update) {
+    if(censusLeft && !update)
+        return;
+    if(! censusLeft) {
+        censusLeft  = (IntImage) imNew(IMAGE_INT, imSizeL);
+        censusRight = (IntImage) imNew(IMAGE_INT, imSizeR);
+    }
+    GeneralImage L = (imLeft? (GeneralImage)imLeft:  (GeneralImage)imColorLeft);
+    GeneralImage R = (imLeft? (GeneralImage)imRight:(GeneralImage)imColorRight);
+    const int c = (imLeft? 1: 3);
+
+    const int h = imSizeL.y+imSizeR.y;
+#ifdef _OPENMP
+#pragma omp parallel for schedule(static)
+#endif
+    for(int y=0; y<h; y++)
+        if(y<imSizeL.y) CensusRow(L, c, imSizeL, y,           censusLeft);
+        else            CensusRow(R, c, imSizeR, y-imSizeL.y, censusRight);
+}
+
+/************************************************************/
+/******************* Cost volume ****************************/
+/************************************************************/
+
+/// Precompute data penalties for all pixels and disparities.
+///
+/// This takes 2 bytes per pixel and disparity, but each move of the algorithm
+/// then reads data costs instead of computing them. If memory is lacking,
+/// costs remain computed on the fly. An allocated volume (not mapped from the
+/// cache) is reused, see SetImagePair.
+void Match::InitCostVolume() {
+    if(costVolumeMap)
+        FreeCostVolume();
+
+    const int dispSize = dispMax-dispMin+1;
+    const size_t n = (size_t)imSizeL.x*imSizeL.y;
+    short* volume = const_cast<short*>(costVolume);
+    costVolume = 0; // So that data_penalty computes the costs
+    if(! volume)
+        volume = new (std::nothrow) short[n*dispSize];
+    if(! volume) {
+        std::cerr << "Not enough memory for cost volume, "
+                  << "data costs computed on the fly" << std::endl;
+        return;
+    }
+
+    const int h = dispSize*imSizeL.y; // Rows of all disparities
+#ifdef _OPENMP
+#pragma omp parallel for schedule(static)
+#endif
+    for(int i=0; i<h; i++) {
+        const int d = dispMin + i/imSizeL.y;
+        short* row = volume + (size_t)i*imSizeL.x;
+        for(Coord p(0,i%imSizeL.y); p.x<imSizeL.x; p.x++)
+            row[p.x] = (short)(inRect(p+d,imSizeR)? data_penalty(p,p+d): 0);
+    }
+    costVolume = volume;
+    costVolumeType = params.dataCost;
+}
+
+/// Prepare computation of data costs for current parameters.
+///
+/// If a cost volume is required and a cache directory is set, the volume is
+/// read from the cache when present, skipping any data cost computation, and
+/// saved to it otherwise. With a memory budget, the cost volume is computed
+/// only by tiles (see RunTiles), without cache.
+void Match::InitDataCost() {
+    const bool volume = (params.bCostVolume && params.memoryBudget<=0);
+    if(volume && costVolume && costVolumeType==params.dataCost)
+        return;
+    FreeCostVolume();
+    std::string cacheFile;
+    if(volume && !cacheDir.empty()) {
+        cacheFile = CostVolumeCacheFile();
+        if(LoadCostVolume(cacheFile))
+            return;
+    }
 
-        SubPixelColor(imColorLeft,  imColorLeftMin,  imColorLeftMax);
-        SubPixelColor(imColorRight, imColorRightMin, imColorRightMax);
+    if(params.dataCost==Parameters::CENSUS)
+        InitCensus();
+    else
+        InitSubPixel();
+    if(volume) {
+        InitCostVolume();
+        if(costVolume && !cacheFile.empty())
+            SaveCostVolume(cacheFile);
     }
 }
 
@@ -177,7 +391,8 @@ int Match::smoothness_penalty_gray(Coord p1, Coord p2, int disp) const {
     // |I1(p1)-I1(p2)| and |I2(p1+disp)-I2(p2+disp)|
     int dl = IMREF(imLeft,  p1     ) - IMREF(imLeft,  p2     );
     int dr = IMREF(imRight, p1+disp) - IMREF(imRight, p2+disp);
-    if (dl<0) dl = -dl; if (dr<0) dr = -dr;
+    if (dl<0) dl = -dl;
+    if (dr<0) dr = -dr;
     return (dl<params.edgeThresh && dr<params.edgeThresh)?
         params.lambda1: params.lambda2;
 }
@@ -187,9 +402,11 @@ int Match::smoothness_penalty_color(Coord p1, Coord p2, int disp) const {
     int d, dMax=0; // Max inf norm in RGB space of (p1,p2) and (p1+disp,p2+disp)
     for(int i=0; i<3; i++) {
         d = IMREF(imColorLeft,  p1     ).c[i]-IMREF(imColorLeft,  p2     ).c[i];
-        if(d<0) d = -d; if (dMax<d) dMax = d;
+        if(d<0) d = -d;
+        if(dMax<d) dMax = d;
         d = IMREF(imColorRight, p1+disp).c[i]-IMREF(imColorRight, p2+disp).c[i];
-        if(d<0) d = -d; if (dMax<d) dMax = d;
+        if(d<0) d = -d;
+        if(dMax<d) dMax = d;
     }
     return (dMax<params.edgeThresh)? params.lambda1: params.lambda2;
 }
@@ -197,5 +414,6 @@ int Match::smoothness_penalty_color(Coord p1, Coord p2, int disp) const {
 /// Set parameters for algorithm
 void Match::SetParameters(Parameters *_params) {
     params = *_params;
-    InitSubPixel();
+    InitDataCost();
+    FreeEnergyCheck();
 }
@@ -59,15 +59,21 @@ public:
 
     TotalValue minimize();
     int get_var(Var x) const;
+    void get_vars1(std::vector<Var>& vars) const;
+    TotalValue zero_value() const;
+    using Graph<short,short,int>::memory;
+    using Graph<short,short,int>::set_abort;
+    using Graph<short,short,int>::aborted;
 
 private:
     TotalValue Econst; ///< Constant added to the energy
+    TotalValue Ezero; ///< Energy when all variables are 0
 };
 
 /// Constructor.
 /// For efficiency, it is advised to give appropriate hint sizes.
 inline Energy::Energy(int hintNbNodes, int hintNbArcs)
-: Graph<short,short,int>(hintNbNodes, hintNbArcs), Econst(0)
+: Graph<short,short,int>(hintNbNodes, hintNbArcs), Econst(0), Ezero(0)
 {}
 
 /// Destructor
@@ -81,12 +87,13 @@ inline Energy::Var Energy::add_variable(Value E0, Value E1) {
 }
 
 /// Add a constant to the energy function
-inline void Energy::add_constant(Value A) { Econst += A; }
+inline void Energy::add_constant(Value A) { Econst += A; Ezero += A; }
 
 /// Add a term E(x) of one binary variable to the energy function, where
 /// E(0)=E0, E(1)=E1. E0 and E1 can be arbitrary.
 inline void Energy::add_term1(Var x, Value E0, Value E1) {
     add_tweights(x, E1, E0);
+    Ezero += E0;
 }
 
 /// Add a term E(x,y) of two binary variables to the energy function, where
@@ -98,6 +105,7 @@ inline void Energy::add_term2(Var x, Var y, Value A, Value B, Value C, Value D){
     add_tweights(x, D, B);
     add_tweights(y, 0, A-B);
     add_edge(x, y, 0, B+C-A-D);
+    Ezero += A;
 }
 
 /// Forbid (x,y)=(0,1) by putting infinite value to the arc from x to y.
@@ -113,4 +121,14 @@ inline Energy::TotalValue Energy::minimize() { return Econst + maxflow(); }
 /// in the optimal solution. Can be 0 or 1.
 inline int Energy::get_var(Var x) const { return (int)what_segment(x, SINK); }
 
+/// After 'minimize' has been called, append to 'vars' the variables of value 1
+/// in the optimal solution, in increasing order.
+inline void Energy::get_vars1(std::vector<Var>& vars) const {
+    segment_nodes(SINK, vars, SINK);
+}
+
+/// Value of the function when all variables are 0. Compared to the result of
+/// 'minimize', it shows how much the optimal solution decreases the energy.
+inline Energy::TotalValue Energy::zero_value() const { return Ezero; }
+
 #endif
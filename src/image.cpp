@@ -18,6 +18,7 @@
 
 #include <cstdio>
 #include <cstring>
+#include <algorithm>
 #include <cassert>
 #include <iostream>
 #include <fstream>
@@ -47,6 +48,8 @@ void* imNew(ImageType type, int xsize, int ysize)
     case IMAGE_RGB:    data_size = sizeof(unsigned char[3]); break;
     case IMAGE_INT:    data_size = sizeof(int);              break;
     case IMAGE_FLOAT:  data_size = sizeof(float);            break;
+    case IMAGE_SHORT:  data_size = sizeof(short);            break;
+    case IMAGE_INT2:   data_size = sizeof(int[2]);           break;
     default: return NULL;
     }
 
@@ -92,9 +95,60 @@ void SwapBytes(GeneralImage im)
     }
 }
 
+/// Load float image from gray PFM file, whose rows are stored bottom-up.
+static float* read_pfm(const char *filename, size_t* xsize, size_t* ysize)
+{
+    std::ifstream file(filename, std::ifstream::binary);
+    std::string magic;
+    float scale;
+    if(!(file >> magic >> *xsize >> *ysize >> scale) || magic!="Pf")
+        return 0;
+    file.get(); // Single whitespace before data
+    const size_t size = (*xsize)*(*ysize);
+    float* data = (float*) malloc(size*sizeof(float));
+    if(! data) return 0;
+    for(size_t y=*ysize; y-- > 0;)
+        if(! file.read((char*)(data+y*(*xsize)), (*xsize)*sizeof(float))) {
+            free(data); return 0;
+        }
+    const bool littleEndian = (scale<0);
+    if(littleEndian == (SWAP_BYTES==1)) // Endianness of file is not native
+        for(size_t i=0; i<size; i++) {
+            char* c = (char*)(data+i);
+            std::swap(c[0],c[3]);
+            std::swap(c[1],c[2]);
+        }
+    return data;
+}
+
+/// Load float image from TIFF or PFM file
+static void* imLoadFloat(const char *filename)
+{
+    float* data=0;
+    size_t xsize, ysize;
+    const char* ext = strrchr(filename,'.');
+    if(ext && (strcmp(ext,".tif")==0||strcmp(ext,".tiff")==0)) {
+#ifdef HAS_TIFF
+        data = io_tiff_read_f32_gray(filename, &xsize, &ysize);
+#else
+        std::cerr << "Unable to read file " << filename << " as TIFF since the "
+                  << "program was built without TIFF support" << std::endl;
+#endif
+    } else
+        data = read_pfm(filename, &xsize, &ysize);
+    if(! data) return 0;
+
+    FloatImage im = (FloatImage) imNew(IMAGE_FLOAT, xsize, ysize);
+    std::copy(data, data+xsize*ysize, im->data);
+    free(data);
+    return im;
+}
+
 /// Load image
 void* imLoad(ImageType type, const char *filename)
 {
+    if(type == IMAGE_FLOAT)
+        return imLoadFloat(filename);
     assert(type==IMAGE_GRAY || type==IMAGE_RGB);
     unsigned char* data=0;
     size_t xsize, ysize;
@@ -58,7 +58,9 @@ typedef enum
     IMAGE_GRAY,
     IMAGE_RGB,
     IMAGE_INT,
-    IMAGE_FLOAT
+    IMAGE_FLOAT,
+    IMAGE_SHORT,
+    IMAGE_INT2
 } ImageType;
 
 typedef struct ImageHeader_st
@@ -74,6 +76,8 @@ typedef struct GrayImage_t  {unsigned char                *data;} *GrayImage;
 typedef struct RGBImage_t   {struct {unsigned char c[3];} *data;} *RGBImage;
 typedef struct IntImage_t   {int                          *data;} *IntImage;
 typedef struct FloatImage_t {float                        *data;} *FloatImage;
+typedef struct ShortImage_t {short                        *data;} *ShortImage;
+typedef struct Int2Image_t  {struct {int c[2];}           *data;} *Int2Image;
 
 #define imHeader(im) ((ImageHeader*) ( ((char*)(im)) - sizeof(ImageHeader) ))
 
@@ -141,7 +141,7 @@ static void *_io_png_read_abort(FILE * fp,
  */
 static void *io_png_read_raw(const char *fname,
                              size_t * nxp, size_t * nyp, size_t * ncp,
-                             int png_transform, int dtype)
+                             volatile int png_transform, int dtype)
 {
     png_byte png_sig[PNG_SIG_LEN];
     png_structp png_ptr;
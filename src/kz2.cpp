@@ -18,10 +18,16 @@
 
 #include "match.h"
 #include "energy.h"
+#include "progress.h"
+#include "timer.h"
 #include <iostream>
 #include <iomanip>
 #include <sstream>
 #include <string>
+#include <algorithm>
+#include <vector>
+#include <cstdlib>
+#include <utility>
 #include <cassert>
 
 /// (half of) the neighborhood system.
@@ -31,8 +37,7 @@ const struct Coord NEIGHBORS[] = { Coord(-1,0), Coord(0,1) };
 
 /// Compute the data+occlusion penalty (D(a)-K)
 int Match::data_occlusion_penalty(Coord p, Coord q) const {
-    int D = (imLeft? data_penalty_gray(p,q): data_penalty_color(p,q));
-    return params.denominator*D - params.K;
+    return params.denominator*data_penalty(p,q) - params.K;
 }
 
 /// Compute the smoothness penalty of assignments (p1,p1+d) and (p2,p2+d)
@@ -42,40 +47,236 @@ int Match::smoothness_penalty(Coord p1, Coord p2, int d) const {
             smoothness_penalty_color(p1,p2,d));
 }
 
+/// Terms of the energy attached to pixel p1: its data+occlusion penalty and
+/// the smoothness penalties with its neighbors p1+NEIGHBORS[k].
+int Match::pixel_energy(Coord p1) const {
+    int E = 0;
+    int d1 = IMREF(d_left,p1);
+    if(d1!=OCCLUDED)
+        E += data_occlusion_penalty(p1, p1+d1);
+
+    for(unsigned int k=0; k<NEIGHBOR_NUM; k++) {
+        Coord p2 = p1 + NEIGHBORS[k];
+        if(inRect(p2,imSizeL)) {
+            int d2 = IMREF(d_left, p2);
+            if(d1==d2) continue; // smoothness satisfied
+            if(d1!=OCCLUDED && inRect(p2+d1,imSizeR))
+                E += smoothness_penalty(p1, p2, d1);
+            if(d2!=OCCLUDED && inRect(p1+d2,imSizeR))
+                E += smoothness_penalty(p1, p2, d2);
+        }
+    }
+    return E;
+}
+
 /// Compute current energy.
 /// We use this function only for sanity check.
 int Match::ComputeEnergy() const {
     int E = 0;
-
     RectIterator end=rectEnd(imSizeL);
-    for(RectIterator p1=rectBegin(imSizeL); p1!=end; ++p1) {
-        int d1 = IMREF(d_left,*p1);
-        if(d1!=OCCLUDED)
-            E += data_occlusion_penalty(*p1, *p1+d1);
+    for(RectIterator p=rectBegin(imSizeL); p!=end; ++p)
+        E += pixel_energy(*p);
+    return E;
+}
 
-        for(unsigned int k=0; k<NEIGHBOR_NUM; k++) {
-            Coord p2 = *p1 + NEIGHBORS[k];
-            if(inRect(p2,imSizeL)) {
-                int d2 = IMREF(d_left, p2);
-                if(d1==d2) continue; // smoothness satisfied
-                if(d1!=OCCLUDED && inRect( p2+d1,imSizeR))
-                    E += smoothness_penalty(*p1, p2, d1);
-                if(d2!=OCCLUDED && inRect(*p1+d2,imSizeR))
-                    E += smoothness_penalty(*p1, p2, d2);
+/// Sanity check that E is the energy of the current disparity map, for debug
+/// builds. The first call computes the terms of each pixel (see
+/// pixel_energy), the next ones compute again only the terms involving
+/// pixels whose disparity changed since the previous call.
+bool Match::CheckEnergy() {
+    if(! pixelE) {
+        checkedDisp = (ShortImage)imNew(IMAGE_SHORT, imSizeL);
+        pixelE = (IntImage)imNew(IMAGE_INT, imSizeL);
+        if(! checkedDisp || ! pixelE)
+            { std::cerr << "Not enough memory!" << std::endl; exit(1); }
+        checkedE = 0;
+        RectIterator end=rectEnd(imSizeL);
+        for(RectIterator p=rectBegin(imSizeL); p!=end; ++p) {
+            IMREF(checkedDisp,*p) = IMREF(d_left,*p);
+            checkedE += IMREF(pixelE,*p) = pixel_energy(*p);
+        }
+        return (checkedE==E);
+    }
+
+    const int w = imSizeL.x;
+    for(int y=0; y<imSizeL.y; y++) {
+        if(std::equal(&imRef(d_left,0,y), &imRef(d_left,0,y)+w,
+                      &imRef(checkedDisp,0,y)))
+            continue;
+        for(Coord p(0,y); p.x<w; p.x++) {
+            if(IMREF(d_left,p)==IMREF(checkedDisp,p))
+                continue;
+            IMREF(checkedDisp,p) = IMREF(d_left,p);
+            for(int k=-1; k<(int)NEIGHBOR_NUM; k++) { // p and q: q+N[k]==p
+                Coord q = p;
+                if(k>=0)
+                    q = Coord(p.x-NEIGHBORS[k].x, p.y-NEIGHBORS[k].y);
+                if(! inRect(q,imSizeL))
+                    continue;
+                const int e = pixel_energy(q);
+                checkedE += e-IMREF(pixelE,q);
+                IMREF(pixelE,q) = e;
             }
         }
     }
+    return (checkedE==E);
+}
 
-    return E;
+/// Discard the terms computed by CheckEnergy, when the data or smoothness
+/// term changes.
+void Match::FreeEnergyCheck() {
+    imFree(checkedDisp);
+    imFree(pixelE);
+    checkedDisp = 0;
+    pixelE = 0;
+}
+
+/// Is the deadline passed?
+bool Match::past_deadline() const {
+    return (deadline>0 && wall_time()>=deadline);
+}
+
+/// Is the decrease of energy from oldE in the last iteration below the
+/// tolerance?
+bool Match::converged(int oldE) const {
+    if(params.tolerance<=0)
+        return false;
+    float tol = params.tolerance;
+    if(params.bRelativeTolerance)
+        tol *= 0.01f*std::abs(oldE);
+    return (oldE-E < tol);
 }
 
-/// VAR_ALPHA means disparity alpha before expansion move (in vars0 and varsA)
+/// Argument of Energy::set_abort, stopping maxflow at time *(double*)t.
+static bool deadline_passed(void* t) {
+    return (wall_time() >= *(double*)t);
+}
+
+/// VAR_ALPHA means disparity alpha before expansion move (in c[0] and c[1] of
+/// vars)
 static const Energy::Var VAR_ALPHA     = ((Energy::Var)-1);
-/// VAR_ABSENT means occlusion in vars0, and p+alpha outside image in varsA
+/// VAR_ABSENT means occlusion in c[0], and p+alpha outside image in c[1]
 static const Energy::Var VAR_ABSENT = ((Energy::Var)-2);
+/// VAR_KEEP means assignment fixed in its current state (in c[0] and c[1]),
+/// for pixels outside the region of a restricted move
+static const Energy::Var VAR_KEEP   = ((Energy::Var)-3);
 /// Indicate if the variable has a regular value
 inline bool IS_VAR(Energy::Var var) { return (var>=0); }
 
+/// Values in region image of restricted moves
+static const unsigned char REGION_OUT=0; ///< Pixel kept fixed
+static const unsigned char REGION_IN=1;  ///< Pixel free to change
+/// Pixel free to change, except to alpha: (p,p+alpha) is in conflict with
+/// the fixed assignment of a pixel outside the region.
+static const unsigned char REGION_BLOCKED=2;
+
+/// Is pixel p free to change in the current move?
+inline bool Match::in_region(Coord p) const {
+    return (!region || IMREF(region,p)!=REGION_OUT);
+}
+
+/// Variable of assignment (p,p+d) in A^0. Outside the region, it is fixed.
+int Match::var0(Coord p, int a) const {
+    if(in_region(p))
+        return IMREF(vars,p).c[0];
+    int d = IMREF(d_left,p);
+    return (d==a)? VAR_ALPHA: (d==OCCLUDED)? VAR_ABSENT: VAR_KEEP;
+}
+
+/// Variable of assignment (p,p+a) in A^a. Outside the region, it is fixed.
+int Match::varA(Coord p, int a) const {
+    if(in_region(p))
+        return IMREF(vars,p).c[1];
+    return (IMREF(d_left,p)==a)? VAR_ALPHA:
+        inRect(p+a,imSizeR)? VAR_KEEP: VAR_ABSENT;
+}
+
+/// Dilate binary line of n values separated by stride with a segment of
+/// radius h. Buffer sum must have size n+1.
+static void dilate_line(unsigned char* line, int n, int stride, int h,
+                        int* sum) {
+    sum[0] = 0;
+    for(int i=0; i<n; i++)
+        sum[i+1] = sum[i] + (line[i*stride]!=REGION_OUT);
+    for(int i=0; i<n; i++)
+        line[i*stride] = (sum[std::min(n,i+h+1)] > sum[std::max(0,i-h)])?
+            REGION_IN: REGION_OUT;
+}
+
+/// Is the data+occlusion penalty of (p,p+a) not larger than the current one?
+/// If \a strict, it must be lower.
+bool Match::competitive(Coord p, int a, bool strict) const {
+    int d = IMREF(d_left,p);
+    if(d==a || !inRect(p+a,imSizeR) || !allowed(p,a))
+        return false;
+    int cur = (d==OCCLUDED)? 0: data_occlusion_penalty(p,p+d);
+    int D = data_occlusion_penalty(p,p+a);
+    return (strict? D<cur: D<=cur);
+}
+
+/// Compute the region of a restricted alpha-expansion move.
+///
+/// Its core is the set of pixels whose data+occlusion penalty at alpha is not
+/// larger than the current one. A square halo of radius params.regionHalo is
+/// added, letting smoothness drag neighbors to alpha. Without regionHalo but
+/// with windows of allowed disparities, the core is the set of pixels where
+/// alpha is allowed and the halo has radius 1, so that neighbors can free
+/// their matches. Fixed rows are excluded. Return the number of pixels in the
+/// region.
+int Match::build_region(int a) {
+    if(! region) {
+        region = (GrayImage)imNew(IMAGE_GRAY, imSizeL);
+        if(! region)
+            { std::cerr << "Not enough memory!" << std::endl; exit(1); }
+    }
+
+    RectIterator end=rectEnd(imSizeL);
+    const bool comp = (params.regionHalo>=0);
+    for(RectIterator p=rectBegin(imSizeL); p!=end; ++p)
+        IMREF(region,*p) = (comp? competitive(*p,a): allowed(*p,a))?
+            REGION_IN: REGION_OUT;
+
+    const int h = comp? params.regionHalo: dispLo? 1: 0;
+    if(h>0) { // Separable dilation
+        int* sum = new int[std::max(imSizeL.x,imSizeL.y)+1];
+        for(int y=0; y<imSizeL.y; y++)
+            dilate_line(&imRef(region,0,y), imSizeL.x, 1, h, sum);
+        for(int x=0; x<imSizeL.x; x++)
+            dilate_line(&imRef(region,x,0), imSizeL.y, imSizeL.x, h, sum);
+        delete [] sum;
+    }
+    for(int y=0; y<imSizeL.y; y++) // Fixed rows
+        if(y<fixedTop || y>=imSizeL.y-fixedBottom)
+            std::fill_n(&imRef(region,0,y), imSizeL.x, REGION_OUT);
+
+    int n=0;
+    for(RectIterator p=rectBegin(imSizeL); p!=end; ++p) {
+        if(IMREF(region,*p)!=REGION_OUT) {
+            ++n;
+            continue;
+        }
+        int d = IMREF(d_left,*p);
+        if(d==OCCLUDED || d==a)
+            continue;
+        Coord q = *p+(d-a); // q+a==p+d, kept by p
+        if(inRect(q,imSizeL) && IMREF(region,q)!=REGION_OUT)
+            IMREF(region,q) = REGION_BLOCKED;
+    }
+    return n;
+}
+
+/// Penalize by delta different values of x and y. Each one is either a
+/// variable or fixed: VAR_KEEP at 0, VAR_ALPHA at 1.
+static void add_different(Energy& e, Energy::Var x, Energy::Var y,
+                          int delta) {
+    if(IS_VAR(x) && IS_VAR(y))
+        e.add_term2(x, y, 0, delta, delta, 0);
+    else if(IS_VAR(x))
+        e.add_term1(x, (y==VAR_ALPHA)? delta: 0, (y==VAR_ALPHA)? 0: delta);
+    else if(IS_VAR(y))
+        e.add_term1(y, (x==VAR_ALPHA)? delta: 0, (x==VAR_ALPHA)? 0: delta);
+}
+
 /// Build nodes in graph representing data+occlusion penalty for pixel p.
 ///
 /// For assignments in A^0:       SOURCE means active, SINK means inactive.
@@ -84,47 +285,43 @@ void Match::build_nodes(Energy& e, Coord p, int a) {
     int d = IMREF(d_left, p);
     Coord q = p+d;
     if(a==d) { // active assignment (p,p+a) in A^a will remain active
-        IMREF(vars0, p) = VAR_ALPHA;
-        IMREF(varsA, p) = VAR_ALPHA;
+        IMREF(vars,p).c[0] = VAR_ALPHA;
+        IMREF(vars,p).c[1] = VAR_ALPHA;
         e.add_constant(data_occlusion_penalty(p,q));
         return;
     }
 
-    IMREF(vars0, p) = (d!=OCCLUDED)? // (p,p+d) in A^0 can remain active
+    IMREF(vars,p).c[0] = (d!=OCCLUDED)? // (p,p+d) in A^0 can remain active
         e.add_variable(data_occlusion_penalty(p,q), 0): VAR_ABSENT;
 
     q = p+a;
-    IMREF(varsA, p) = inRect(q,imSizeR)? // (p,p+a) in A^a can become active
-        e.add_variable(0, data_occlusion_penalty(p,q)): VAR_ABSENT;
+    if(! inRect(q,imSizeR))
+        IMREF(vars,p).c[1] = VAR_ABSENT;
+    else if((region && IMREF(region,p)==REGION_BLOCKED) || !allowed(p,a))
+        IMREF(vars,p).c[1] = VAR_KEEP;
+    else // (p,p+a) can become active
+        IMREF(vars,p).c[1] = e.add_variable(0,data_occlusion_penalty(p,q));
 }
 
 /// Build smoothness term for neighbor pixels p1 and p2 with disparity a.
+/// At least one of them must be in the region of the move.
 void Match::build_smoothness(Energy& e, Coord p1, Coord p2, int a) {
     int d1 = IMREF(d_left, p1);
-    Energy::Var o1 = (Energy::Var) IMREF(vars0, p1);
-    Energy::Var a1 = (Energy::Var) IMREF(varsA, p1);
+    Energy::Var o1 = (Energy::Var) var0(p1, a);
+    Energy::Var a1 = (Energy::Var) varA(p1, a);
 
     int d2 = IMREF(d_left, p2);
-    Energy::Var o2 = (Energy::Var) IMREF(vars0, p2);
-    Energy::Var a2 = (Energy::Var) IMREF(varsA, p2);
+    Energy::Var o2 = (Energy::Var) var0(p2, a);
+    Energy::Var a2 = (Energy::Var) varA(p2, a);
 
     // disparity a
-    if(a1!=VAR_ABSENT && a2!=VAR_ABSENT) {
-        int delta = smoothness_penalty(p1, p2, a);
-        if(a1 != VAR_ALPHA) { // (p1,p1+a) is variable
-            if(a2 != VAR_ALPHA) // Penalize different activity
-                e.add_term2(a1, a2, 0, delta, delta, 0);
-            else // Penalize (p1,p1+a) inactive
-                e.add_term1(a1, delta, 0);
-        } else if(a2 != VAR_ALPHA) // (p1,p1+a) active, (p2,p2+a) variable
-            e.add_term1(a2, delta, 0); // Penalize (p2,p2+a) inactive
-    }
+    if(a1!=VAR_ABSENT && a2!=VAR_ABSENT && (IS_VAR(a1) || IS_VAR(a2)))
+        add_different(e, a1, a2, smoothness_penalty(p1,p2,a));
 
     // disparity d==nd!=a
-    if(d1==d2 && IS_VAR(o1) && IS_VAR(o2)) {
+    if(d1==d2 && (IS_VAR(o1) || IS_VAR(o2))) {
         assert(d1!=a && d1!=OCCLUDED);
-        int delta = smoothness_penalty(p1,p2,d1);
-        e.add_term2(o1, o2, 0, delta, delta, 0); // Penalize different activity
+        add_different(e, o1, o2, smoothness_penalty(p1,p2,d1));
     }
 
     // disparity d1, a!=d1!=d2, (p2,p2+d1) inactive neighbor assignment
@@ -140,13 +337,13 @@ void Match::build_smoothness(Energy& e, Coord p1, Coord p2, int a) {
 /// - Prevent (p,p+d) and (p,p+a) from being both active.
 /// - Prevent (p,p+d) and (p+d-alpha,p+d) from being both active.
 void Match::build_uniqueness(Energy& e, Coord p, int alpha) {
-    Energy::Var o = (Energy::Var) IMREF(vars0, p);
+    Energy::Var o = (Energy::Var) IMREF(vars,p).c[0];
     if(! IS_VAR(o))
         return;
 
     // Enfore unique image of p
-    Energy::Var a = (Energy::Var) IMREF(varsA, p);
-    if(a!=VAR_ABSENT)
+    Energy::Var a = (Energy::Var) IMREF(vars,p).c[1];
+    if(IS_VAR(a))
         e.forbid01(o,a);
 
     // Enforce unique antecedent of p+d
@@ -154,115 +351,782 @@ void Match::build_uniqueness(Energy& e, Coord p, int alpha) {
     assert(d!=OCCLUDED);
     p = p+(d-alpha);
     if(inRect(p,imSizeL)) {
-        a = (Energy::Var) IMREF(varsA, p);
-        assert(IS_VAR(a)); // not active because of current uniqueness
-        e.forbid01(o, a);
+        a = (Energy::Var) varA(p, alpha);
+        // not active because of current uniqueness
+        assert(a!=VAR_ALPHA && a!=VAR_ABSENT);
+        if(IS_VAR(a)) // else fixed inactive
+            e.forbid01(o, a);
     }
 }
 
-/// Update the disparity map according to min cut of energy.
-void Match::update_disparity(const Energy& e, int alpha) {
-    RectIterator end=rectEnd(imSizeL);
-    for(RectIterator p=rectBegin(imSizeL); p!=end; ++p) {
-        Energy::Var o = (Energy::Var) IMREF(vars0,*p);
-        if(IS_VAR(o) && e.get_var(o)==1)
-            IMREF(d_left,*p) = OCCLUDED;
+/// Extend the rectangle [pMin,pMax] so that it contains p.
+static void extend_box(Coord& pMin, Coord& pMax, Coord p) {
+    if(p.x<pMin.x) pMin.x = p.x;
+    if(p.y<pMin.y) pMin.y = p.y;
+    if(p.x>pMax.x) pMax.x = p.x;
+    if(p.y>pMax.y) pMax.y = p.y;
+}
+
+/// Update the disparity map according to min cut of energy. Only the pixels
+/// of the variables of value 1 are visited, varPixel giving the pixel index
+/// of each variable (see build_graph). The bounding box of modified pixels is
+/// extended in changedMin, changedMax, the range of their former disparities
+/// in changedDisp (x: min, y: max).
+///
+/// Variables of value 1 are assignments (p,p+d) becoming inactive, making p
+/// occluded, and (p,p+a) becoming active. The latter is created after the
+/// former for the same pixel, so that p ends up with disparity alpha.
+void Match::update_disparity(const Energy& e, int alpha,
+                             const std::vector<int>& varPixel) {
+    std::vector<Energy::Var> flipped;
+    e.get_vars1(flipped);
+    for(std::vector<Energy::Var>::const_iterator it=flipped.begin();
+        it!=flipped.end(); ++it) {
+        const int i = varPixel[*it];
+        const Coord p(i%imSizeL.x, i/imSizeL.x);
+        if(IMREF(vars,p).c[0]==*it) { // (p,p+d) inactive
+            int d = IMREF(d_left,p);
+            changedDisp.x = std::min(changedDisp.x, d);
+            changedDisp.y = std::max(changedDisp.y, d);
+            IMREF(d_left,p) = OCCLUDED;
+        } else // New disparity
+            IMREF(d_left,p) = alpha;
+        extend_box(changedMin, changedMax, p);
     }
-    for(RectIterator p=rectBegin(imSizeL); p!=end; ++p) {
-        Energy::Var a = (Energy::Var) IMREF(varsA,*p);
-        if(IS_VAR(a) && e.get_var(a)==1) // New disparity
-            IMREF(d_left,*p) = alpha;
+}
+
+/// Build the graph of the a-expansion for pixels in rows [y0,y1). Rows y0-1
+/// and y1, if in the image, must be out of the region of the move, unless
+/// they are the whole image. The pixel index of each variable is appended to
+/// varPixel.
+///
+/// The graph is built in a single pass over the rows: the nodes of a row
+/// first, since uniqueness links pixels of a same row, then the terms of
+/// its pixels with their left neighbor and the row above, already built.
+void Match::build_graph(Energy& e, int a, int y0, int y1,
+                        std::vector<int>& varPixel) {
+    const Coord up(0,-1), down(0,1), left(-1,0);
+    for(Coord p(0,y0); p.y<y1; p.y++) {
+        for(p.x=0; p.x<imSizeL.x; p.x++)
+            if(in_region(p)) {
+                build_nodes(e, p, a);
+                const int i = p.y*imSizeL.x+p.x;
+                if(IS_VAR(IMREF(vars,p).c[0])) varPixel.push_back(i);
+                if(IS_VAR(IMREF(vars,p).c[1])) varPixel.push_back(i);
+            }
+        const bool top=(p.y==0), bottom=(p.y+1==y1 && y1<imSizeL.y);
+        for(p.x=0; p.x<imSizeL.x; p.x++) {
+            const bool in = in_region(p);
+            if(p.x>0 && (in || in_region(p+left)))
+                build_smoothness(e, p, p+left, a);
+            if(!top && (in || in_region(p+up)))
+                build_smoothness(e, p+up, p, a);
+            if(bottom && in) // Row y1 is out of region
+                build_smoothness(e, p, p+down, a);
+            if(in)
+                build_uniqueness(e, p, a);
+        }
     }
 }
 
 /// Compute the minimum a-expansion configuration.
 ///
-/// Return whether the move is different from identity.
-bool Match::ExpansionMove(int a) {
+/// If params.regionHalo>=0, disparities are restricted by windows or some
+/// rows are fixed, only pixels of the region (see build_region) may change,
+/// the others are fixed and their interactions become unary terms.
+/// Return ACCEPTED if the move is different from identity. The move is
+/// ABORTED, and the map unchanged, if the deadline passes during the maxflow.
+Match::MoveResult Match::ExpansionMove(int a) {
+    changedMin = imSizeL;
+    changedMax = Coord(-1,-1);
+    changedDisp = Coord(dispMax+1, dispMin-1);
+    if(params.bands>1)
+        return ExpansionMoveBands(a);
+
+    int n = imSizeL.x*imSizeL.y; // Number of pixels free to change
+    if(params.regionHalo>=0 || dispLo || fixedTop>0 || fixedBottom>0)
+        n = build_region(a);
+    if(n==0)
+        return REJECTED;
+
     // Factors 2 and 12 are minimal ensuring no reallocation
-    Energy e(2*imSizeL.x*imSizeL.y, 12*imSizeL.x*imSizeL.y);
+    Energy e(2*n, 12*n);
+    if(deadline>0)
+        e.set_abort(deadline_passed, &deadline);
+    std::vector<int> varPixel;
+    varPixel.reserve(2*n);
+    build_graph(e, a, 0, imSizeL.y, varPixel);
+
+    // Energy of identity move. Without region, it is the current energy.
+    const int E0 = e.zero_value();
+    assert(region || E0==E);
+    int newE = e.minimize(); // Max-flow, give the lowest-energy expansion move
+
+    if(e.aborted())
+        return ABORTED;
+    if(newE<E0) { // lower energy, accept the expansion move
+        E += newE-E0;
+        update_disparity(e, a, varPixel);
+        assert(CheckEnergy());
+        return ACCEPTED;
+    }
+    return REJECTED;
+}
+
+/// Alpha-expansion restricted to bands of rows, separated by rows kept fixed.
+///
+/// The bands have no interaction, as the uniqueness constraint involves
+/// pixels of a same row and the smoothness terms with fixed rows become
+/// unary terms. Their moves are computed in parallel and each one is
+/// accepted if it decreases the energy. Separator rows are shifted by half
+/// the band height when bandShift is set, so that they can change in other
+/// iterations. The move is ABORTED if the maxflow of any band is, the other
+/// bands being still accepted if they decrease the energy.
+Match::MoveResult Match::ExpansionMoveBands(int a) {
+    const int h = std::max(2, (imSizeL.y+params.bands-1)/params.bands);
+    std::vector<int> sep; // Separator rows, with sentinels -1 and height
+    sep.push_back(-1);
+    for(int y=bandShift? h/2: h; y<imSizeL.y; y+=h)
+        sep.push_back(y);
+    sep.push_back(imSizeL.y);
+
+    int n = build_region(a);
+    for(size_t i=1; i+1<sep.size(); i++)
+        for(Coord p(0,sep[i]); p.x<imSizeL.x; p.x++)
+            if(IMREF(region,p)!=REGION_OUT) {
+                IMREF(region,p) = REGION_OUT;
+                --n;
+            }
+    if(n==0)
+        return REJECTED;
+
+    const int nBands = (int)sep.size()-1;
+    std::vector<Energy*> e(nBands);
+    std::vector< std::vector<int> > varPixel(nBands);
+    std::vector<int> E0(nBands), newE(nBands);
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic)
+#endif
+    for(int i=0; i<nBands; i++) {
+        const int y0=sep[i]+1, y1=sep[i+1], m=(y1-y0)*imSizeL.x;
+        e[i] = new Energy(2*m, 12*m);
+        if(deadline>0)
+            e[i]->set_abort(deadline_passed, &deadline);
+        build_graph(*e[i], a, y0, y1, varPixel[i]);
+        E0[i] = e[i]->zero_value();
+        newE[i] = e[i]->minimize();
+    }
+
+    MoveResult result=REJECTED;
+    for(int i=0; i<nBands; i++) {
+        if(e[i]->aborted())
+            result = ABORTED;
+        else if(newE[i]<E0[i]) {
+            E += newE[i]-E0[i];
+            update_disparity(*e[i], a, varPixel[i]);
+            if(result==REJECTED)
+                result = ACCEPTED;
+        }
+        delete e[i];
+    }
+    assert(CheckEnergy());
+    return result;
+}
 
-    // Build graph
-    RectIterator endL=rectEnd(imSizeL);
-    for(RectIterator p=rectBegin(imSizeL); p!=endL; ++p)
-        build_nodes(e, *p, a);
+/// Smoothness penalty of neighbors p1 and p2 at disparities d1 and d2, as in
+/// ComputeEnergy.
+int Match::pair_penalty(Coord p1, Coord p2, int d1, int d2) const {
+    if(d1==d2)
+        return 0;
+    int pen = 0;
+    if(d1!=OCCLUDED && inRect(p2+d1,imSizeR))
+        pen += smoothness_penalty(p1, p2, d1);
+    if(d2!=OCCLUDED && inRect(p1+d2,imSizeR))
+        pen += smoothness_penalty(p1, p2, d2);
+    return pen;
+}
 
-    for(RectIterator p1=rectBegin(imSizeL); p1!=endL; ++p1)
+/// Fusion move: each pixel keeps its disparity (variable 0) or takes the one
+/// in \a proposal (variable 1), a map satisfying uniqueness. The uniqueness
+/// constraint between the two choices is submodular, but not always the
+/// smoothness term. Such terms are increased at (1,0) to become submodular,
+/// giving an upper bound of the energy, exact at the current map: the result
+/// never increases the energy, but may not be the best fusion. Return
+/// ACCEPTED if the map is modified, ABORTED if the deadline passed during the
+/// maxflow.
+Match::MoveResult Match::FusionMove(ShortImage proposal) {
+    Energy e(imSizeL.x*imSizeL.y, 6*imSizeL.x*imSizeL.y);
+    if(deadline>0)
+        e.set_abort(deadline_passed, &deadline);
+    RectIterator end=rectEnd(imSizeL);
+    for(RectIterator p=rectBegin(imSizeL); p!=end; ++p) {
+        int d0=IMREF(d_left,*p), d1=IMREF(proposal,*p);
+        IMREF(vars,*p).c[0] = (d0==d1)? VAR_ABSENT: e.add_variable(
+            (d0==OCCLUDED)? 0: data_occlusion_penalty(*p,*p+d0),
+            (d1==OCCLUDED)? 0: data_occlusion_penalty(*p,*p+d1));
+    }
+
+    bool upperBound=false; // Is a term increased?
+    for(RectIterator p1=rectBegin(imSizeL); p1!=end; ++p1)
         for(unsigned int k=0; k<NEIGHBOR_NUM; k++) {
             Coord p2 = *p1+NEIGHBORS[k];
-            if(inRect(p2,imSizeL))
-                build_smoothness(e, *p1, p2, a);
+            if(! inRect(p2,imSizeL)) continue;
+            Energy::Var x1=IMREF(vars,*p1).c[0], x2=IMREF(vars,p2).c[0];
+            int c1=IMREF(d_left,*p1), f1=IMREF(proposal,*p1);
+            int c2=IMREF(d_left, p2), f2=IMREF(proposal, p2);
+            if(IS_VAR(x1) && IS_VAR(x2)) {
+                int A=pair_penalty(*p1,p2,c1,c2), B=pair_penalty(*p1,p2,c1,f2);
+                int C=pair_penalty(*p1,p2,f1,c2), D=pair_penalty(*p1,p2,f1,f2);
+                if(A+D > B+C) {
+                    C = A+D-B;
+                    upperBound = true;
+                }
+                e.add_term2(x1, x2, A, B, C, D);
+            } else if(IS_VAR(x1))
+                e.add_term1(x1, pair_penalty(*p1,p2,c1,c2),
+                                pair_penalty(*p1,p2,f1,c2));
+            else if(IS_VAR(x2))
+                e.add_term1(x2, pair_penalty(*p1,p2,c1,c2),
+                                pair_penalty(*p1,p2,c1,f2));
+        }
+
+    // Uniqueness: q cannot take the match of p in proposal if p keeps it
+    std::vector<int> antecedent(imSizeR.x); // Current match in left row
+    std::vector< std::pair<Coord,Coord> > conflicts; // (p,q) as above
+    for(int y=0; y<imSizeL.y; y++) {
+        std::fill(antecedent.begin(), antecedent.end(), -1);
+        for(Coord p(0,y); p.x<imSizeL.x; p.x++)
+            if(IMREF(d_left,p)!=OCCLUDED)
+                antecedent[p.x+IMREF(d_left,p)] = p.x;
+        for(Coord q(0,y); q.x<imSizeL.x; q.x++) {
+            Energy::Var x = IMREF(vars,q).c[0];
+            int d = IMREF(proposal,q);
+            if(! IS_VAR(x) || d==OCCLUDED) continue;
+            int xp = antecedent[q.x+d];
+            if(xp<0) continue;
+            Energy::Var xKeep = IMREF(vars,Coord(xp,q.y)).c[0];
+            assert(IS_VAR(xKeep)); // Else proposal would violate uniqueness
+            e.forbid01(xKeep, x);
+            conflicts.push_back(std::make_pair(Coord(xp,q.y), q));
+        }
+    }
+
+    const int E0 = e.zero_value(); // Current energy, up to a constant
+    const int newE = e.minimize();
+    if(e.aborted())
+        return ABORTED;
+    if(newE>=E0)
+        return REJECTED;
+
+    // The infinite capacity of forbid01 is finite: a conflict may remain in
+    // the minimum cut. Then the pixel taking the match keeps its disparity,
+    // until no conflict is left.
+    for(RectIterator p=rectBegin(imSizeL); p!=end; ++p) {
+        Energy::Var x = IMREF(vars,*p).c[0];
+        if(IS_VAR(x) && e.get_var(x)==0)
+            IMREF(vars,*p).c[0] = VAR_ABSENT;
+    }
+    bool repaired=false;
+    for(bool again=true; again;) {
+        again = false;
+        for(size_t i=0; i<conflicts.size(); i++)
+            if(! IS_VAR(IMREF(vars,conflicts[i].first).c[0]) &&
+               IS_VAR(IMREF(vars,conflicts[i].second).c[0])) {
+                IMREF(vars,conflicts[i].second).c[0] = VAR_ABSENT;
+                repaired = again = true;
+            }
+    }
+
+    const int oldE = E;
+    ShortImage current = proposal; // Swapped with d_left at changed pixels
+    for(RectIterator p=rectBegin(imSizeL); p!=end; ++p)
+        if(IS_VAR(IMREF(vars,*p).c[0]))
+            std::swap(IMREF(d_left,*p), IMREF(current,*p));
+    E = (upperBound || repaired)? ComputeEnergy(): E+newE-E0;
+    assert(CheckEnergy());
+    if(E>=oldE) { // Possible only after repair
+        for(RectIterator p=rectBegin(imSizeL); p!=end; ++p)
+            if(IS_VAR(IMREF(vars,*p).c[0]))
+                std::swap(IMREF(d_left,*p), IMREF(current,*p));
+        E = oldE;
+        return REJECTED;
+    }
+
+    changedMin = imSizeL;
+    changedMax = Coord(-1,-1);
+    changedDisp = Coord(dispMax+1, dispMin-1);
+    for(RectIterator p=rectBegin(imSizeL); p!=end; ++p) {
+        if(! IS_VAR(IMREF(vars,*p).c[0])) continue;
+        int d = IMREF(current,*p); // Former disparity
+        if(d!=OCCLUDED) {
+            changedDisp.x = std::min(changedDisp.x, d);
+            changedDisp.y = std::max(changedDisp.y, d);
         }
+        IMREF(current,*p) = IMREF(d_left,*p);
+        extend_box(changedMin, changedMax, *p);
+    }
+    return ACCEPTED;
+}
 
-    for(RectIterator p=rectBegin(imSizeL); p!=endL; ++p)
-        build_uniqueness(e, *p, a);
+/// Neighbor k of p in 4-connectivity, 0<=k<2*NEIGHBOR_NUM.
+inline Coord neighbor(Coord p, int k) {
+    Coord n = NEIGHBORS[k/2];
+    return (k%2==0)? p+n: Coord(p.x-n.x, p.y-n.y);
+}
 
-    int oldE=E;
-    E = e.minimize(); // Max-flow, give the lowest-energy expansion move
+/// Gain bound w(p) if p switches to a: smoothness penalties with neighbors
+/// at a minus D(p,p+a)-K. It is 0 if p cannot switch.
+int Match::switch_gain(Coord p, int a) const {
+    if(IMREF(d_left,p)==a || !inRect(p+a,imSizeR) || !allowed(p,a))
+        return 0;
+    int g = -data_occlusion_penalty(p,p+a);
+    for(int k=0; k<2*(int)NEIGHBOR_NUM; k++) {
+        Coord n = neighbor(p,k);
+        if(inRect(n,imSizeL) && IMREF(d_left,n)==a)
+            g += smoothness_penalty(p,n,a);
+    }
+    return g;
+}
 
-    if(E<oldE) { // lower energy, accept the expansion move
-        update_disparity(e, a);
-        assert(ComputeEnergy()==E);
-        return true;
+/// Tell whether the a-expansion provably cannot decrease the energy.
+///
+/// Assume occluding any set of pixels at a same disparity d!=a does not
+/// decrease the energy. Comparing a move to the one occluding instead all
+/// modified pixels, the decrease of energy of a move switching the set A to
+/// a is at most f(A) = sum_{p in A} w(p) - cut(A), see switch_gain, where
+/// cut(A) is the sum of smoothness penalties between A and its neighbors not
+/// at a. For any flow between neighbors bounded by these smoothness
+/// penalties, f(A) <= sum_p max(0, w(p)-outflow(p)). Such a flow is pushed
+/// greedily in raster order from pixels of positive w to neighbors of negative
+/// w, and false is returned at the first pixel whose w remains positive.
+bool Match::ExpansionCannotDecrease(int a) const {
+    const int w=imSizeL.x, h=imSizeL.y;
+    std::vector<int> excess(w*h); // w(p) minus outflow
+    int yFilled=0; // number of rows where w was computed
+    for(Coord p(0,0); p.y<h; p.y++) {
+        for(; yFilled<h && yFilled<=p.y+1; yFilled++) // Fill one row ahead
+            for(int x=0; x<w; x++)
+                excess[yFilled*w+x] = switch_gain(Coord(x,yFilled), a);
+        for(p.x=0; p.x<w; p.x++) {
+            int& e = excess[p.y*w+p.x];
+            for(int k=0; k<2*(int)NEIGHBOR_NUM && e>0; k++) {
+                Coord n = neighbor(p,k);
+                if(! inRect(n,imSizeL)) continue;
+                int& en = excess[n.y*w+n.x];
+                if(en>=0) continue;
+                int f = std::min(std::min(e,-en), smoothness_penalty(p,n,a));
+                e -= f;
+                en += f;
+            }
+            if(e>0)
+                return false;
+        }
     }
+    return true;
+}
+
+/// Is label a strictly competitive at some pixel of rectangle [pMin,pMax]?
+bool Match::competitive_in(Coord pMin, Coord pMax, int a) const {
+    pMin = Coord(std::max(pMin.x,0), std::max(pMin.y,0));
+    pMax = Coord(std::min(pMax.x,imSizeL.x-1), std::min(pMax.y,imSizeL.y-1));
+    for(Coord p(pMin.x,pMin.y); p.y<=pMax.y; p.y++)
+        for(p.x=pMin.x; p.x<=pMax.x; p.x++)
+            if(competitive(p,a,true))
+                return true;
     return false;
 }
 
-/// Generate a random permutation of the array elements.
+/// After an accepted alpha-expansion, reset entries of \a done for labels
+/// whose expansion may now decrease the energy. Return the number of 'false'
+/// entries.
+///
+/// All labels are reset, unless params.bLocalDone. In that case, label l is
+/// reset only if it is strictly competitive at a pixel interacting with the
+/// ones modified by the move in its expansion:
+/// - their neighbors, for the smoothness term;
+/// - pixels shifted by alpha-l, whose match at l is now taken;
+/// - pixels shifted by d-l, with d a former disparity, whose match is free.
+/// Pixels are taken in the bounding box of modified pixels. Ties are ignored,
+/// as they abound in textureless areas. This is a heuristic, assuming the
+/// move did not make other labels profitable. Labels not in activeLabels
+/// remain done.
+int Match::invalidate_done(bool* done, int alpha) const {
+    const int dispSize = dispMax-dispMin+1;
+    const Coord& p0=changedMin, p1=changedMax;
+    bool all = (! params.bLocalDone || p1.x<p0.x);
+    int n=0;
+    for(int i=0; i<dispSize; i++) {
+        const int l = dispMin+i;
+        if(activeLabels && !activeLabels[i])
+            done[i] = true;
+        else if(done[i] && !all)
+            done[i] = ! (competitive_in(Coord(p0.x-1,p0.y-1),
+                                        Coord(p1.x+1,p1.y+1), l) ||
+                         competitive_in(Coord(p0.x+alpha-l,p0.y),
+                                        Coord(p1.x+alpha-l,p1.y), l) ||
+                         (changedDisp.x<=changedDisp.y &&
+                          competitive_in(Coord(p0.x+changedDisp.x-l,p0.y),
+                                         Coord(p1.x+changedDisp.y-l,p1.y),l)));
+        else
+            done[i] = false;
+        if(! done[i])
+            ++n;
+    }
+    return n;
+}
+
+/// Random number in [0,1], from rand() if \a state is 0, otherwise from the
+/// xorshift generator of \a state, which never becomes 0.
+static double random_unit(unsigned long long& state) {
+    if(state == 0)
+        return (double)rand()/RAND_MAX;
+    state ^= state << 13;
+    state ^= state >> 7;
+    state ^= state << 17;
+    return (double)(state >> 11) / (double)(1ULL << 53);
+}
+
+/// Random permutation of the n elements of \a buf, drawn from rand() or from
+/// the own generator of a band (see SolveTile).
 ///
 /// Fisher-Yates shuffle: http://en.wikipedia.org/wiki/Fisher–Yates_shuffle
-static void generate_permutation(int *buf, int n) {
-    for(int i=0; i<n; i++) buf[i] = i;
+void Match::shuffle(int* buf, int n) {
     for(int i=0; i<n-1; i++) {
-        int j = i + (int) (((double)rand()/RAND_MAX)*(n - i));
+        int j = i + (int) (random_unit(randomState)*(n - i));
         if(j >= n) // Very unlikely, but still possible
             continue;
         std::swap(buf[i],buf[j]);
     }
 }
 
-/// Main algorithm: a series of alpha-expansions.
-void Match::run() {
-    // Display 1 number after decimal separator for number of iterations
-    std::cout << std::fixed << std::setprecision(1);
+/// Compare labels by decreasing score, then increasing index.
+class ScoreGreater {
+    const float* score;
+public:
+    explicit ScoreGreater(const float* s): score(s) {}
+    bool operator()(int i, int j) const {
+        return (score[i]>score[j] || (score[i]==score[j] && i<j));
+    }
+};
+
+/// Label of highest score among those not done, -1 if all are done.
+static int best_label(const float* score, const bool* done, int n) {
+    int best=-1;
+    for(int i=0; i<n; i++)
+        if(!done[i] && (best<0 || score[i]>score[best]))
+            best = i;
+    return best;
+}
+
+/// Iteration of alpha-expansions of labels not done, taken in \a order from
+/// \a index by batches of the size of \a workers. The expansions of a batch
+/// are computed in parallel by the workers from the same disparity map, then
+/// fused in turn into the current map (see FusionMove), since it may have
+/// changed. Moves aborted by the deadline leave their label not done, and
+/// \a index ends at the first of them, or at the first label not tried.
+/// Return the number of expansions.
+int Match::SpeculativeIteration(const int* order, int& index,
+                                bool* done, int& nDone,
+                                float* score, std::vector<Match*>& workers,
+                                double t0) {
+    const int dispSize = dispMax-dispMin+1;
+    const size_t size = (size_t)imSizeL.x*imSizeL.y;
+    std::vector<int> batch, position; // Labels and their index in order
+    std::vector<MoveResult> result(workers.size());
+    int steps=0;
+    while(index<dispSize && !past_deadline()) {
+        batch.clear();
+        position.clear();
+        int next=index;
+        for(; next<dispSize && batch.size()<workers.size(); next++)
+            if(! done[order[next]]) {
+                batch.push_back(order[next]);
+                position.push_back(next);
+            }
+        const int n = (int)batch.size();
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic)
+#endif
+        for(int i=0; i<n; i++) {
+            Match& w = *workers[i];
+            std::copy(d_left->data, d_left->data+size, w.d_left->data);
+            w.E = E;
+            w.bandShift = bandShift;
+            result[i] = w.ExpansionMove(dispMin+batch[i]);
+        }
+        int aborted=-1; // Index in order of first move aborted in batch
+        for(int i=0; i<n; i++) {
+            const int label=batch[i], oldE=E;
+            if(result[i]==ACCEPTED)
+                result[i] = FusionMove(workers[i]->d_left);
+            if(result[i]==ABORTED) { // Not solved, label to try again
+                if(aborted<0)
+                    aborted = position[i];
+                continue;
+            }
+            bool moved = (result[i]==ACCEPTED);
+            if(moved)
+                nDone = invalidate_done(done, dispMin+label);
+            if(progress)
+                progress->move(steps, dispMin+label, moved? '*': '-', E,
+                               wall_time()-t0);
+            if(score)
+                score[label] = 0.5f*(score[label] + (float)(oldE-E));
+            if(! done[label]) {
+                done[label] = true;
+                --nDone;
+            }
+            ++steps;
+        }
+        index = (aborted<0)? next: aborted;
+        if(aborted>=0)
+            break;
+    }
+    return steps;
+}
 
+/// Main algorithm: a series of alpha-expansions, of labels in activeLabels
+/// if not NULL.
+///
+/// The order of labels depends on params.schedule:
+/// - RANDOM: random permutation, drawn again at each iteration if
+///   params.bRandomizeEveryIteration.
+/// - GAIN: by decreasing score at start of each iteration. The score of a
+///   label estimates the energy decrease of its expansion, initially from
+///   winner-take-all (see wta_gains), then averaged with the gains of its
+///   moves.
+/// - PRIORITY: the label of highest score is tried next, so that labels with
+///   recent gains are retried first.
+/// If params.speculative>1, expansions are computed in parallel by batches
+/// (see SpeculativeIteration), in the order of RANDOM or GAIN (the latter
+/// also for PRIORITY).
+/// Before a move, ExpansionCannotDecrease may show it is useless, when no set
+/// of pixels at a same disparity d!=alpha can be occluded with profit. This
+/// is the case for all d!=alpha after a full alpha-expansion, since such
+/// occlusions are alpha-expansions. After an accepted move, labels are tried
+/// again as decided by invalidate_done. The energy, elapsed time and number
+/// of skipped moves are displayed at each iteration, with the relative
+/// decrease of energy dE. The iterations stop when the decrease is below
+/// params.tolerance. No move is started after the deadline, if any, and a
+/// move aborted by it changes neither the state of its label nor the
+/// knowledge of optimal occlusions, so that a checkpoint resumes on it.
+void Match::run() {
+    const double t0 = wall_time();
+    const bool fullMoves = (params.regionHalo<0 && !dispLo &&
+                            params.bands<=1);
     const int dispSize = dispMax-dispMin+1;
-    int* permutation = new int[dispSize]; // random permutation
+    int* permutation = new int[dispSize]; // order of labels
+    float* score = 0; // estimated gain of label expansion
+    if(params.schedule != Parameters::RANDOM) {
+        score = new float[dispSize];
+        wta_gains(score);
+    }
 
     E = ComputeEnergy();
-    std::cout << "E=" << E << std::endl;
+    if(progress) {
+        std::ostringstream s;
+        s << "E=" << E;
+        progress->info(s.str());
+    }
 
     bool* done = new bool[dispSize]; // Can expansion of label decrease energy?
-    std::fill_n(done, dispSize, false);
-    int nDone = dispSize; // number of 'false' entries in 'done'
+    int nDone = 0; // number of 'false' entries in 'done'
+    for(int i=0; i<dispSize; i++) {
+        done[i] = (activeLabels && !activeLabels[i]);
+        if(! done[i])
+            ++nDone;
+    }
+    const int nLabels = nDone; // Labels whose expansion is tried
+
+    // Is there no profitable occlusion of pixels at label? True initially
+    // only if all pixels are occluded: the map may come from a coarser level
+    // of the pyramid (InitFromCoarse), from --init or from the previous frame.
+    bool allOccluded=true;
+    RectIterator end=rectEnd(imSizeL);
+    for(RectIterator p=rectBegin(imSizeL); allOccluded && p!=end; ++p)
+        allOccluded = (IMREF(d_left,*p)==OCCLUDED);
+    bool* occOptimal = new bool[dispSize];
+    std::fill_n(occOptimal, dispSize, allOccluded);
+    int nOccNotOptimal = allOccluded? 0: dispSize; // 'false' in 'occOptimal'
 
     int step=0;
-    for(int iter=0; iter<params.maxIter && nDone>0; iter++) {
-        if(iter==0 || params.bRandomizeEveryIteration)
-            generate_permutation(permutation, dispSize);
+    bool stop=false; // Energy decrease below tolerance
+    Checkpoint state; // Position to start from, see SetCheckpoint
+    state.iter = state.index = 0;
+    state.iterE = E;
+    if(resumed) { // Continue run from checkpoint, see SetCheckpoint
+        state = *resumed;
+        delete resumed;
+        resumed = 0;
+        step = state.step;
+        stop = state.stop;
+        std::copy(state.permutation.begin(), state.permutation.end(),
+                  permutation);
+        std::copy(state.done.begin(), state.done.end(), done);
+        std::copy(state.occOptimal.begin(), state.occOptimal.end(),
+                  occOptimal);
+        std::copy(state.score.begin(), state.score.end(), score);
+        nDone = (int)std::count(done, done+dispSize, false);
+        nOccNotOptimal = (int)std::count(occOptimal,occOptimal+dispSize,false);
+    }
+    double tCheckpoint = wall_time();
 
-        for(int index=0; index<dispSize; index++) {
-            int label = permutation[index];
+    std::vector<Match*> workers; // For speculative expansions
+    for(int i=0; params.speculative>1 && i<params.speculative; i++)
+        workers.push_back(new Match(*this));
+
+    for(int iter=state.iter; iter<params.maxIter && nDone>0 && !stop &&
+            !past_deadline(); iter++) {
+        const bool resume = (iter==state.iter && state.index>0);
+        const int oldE = (iter==state.iter)? state.iterE: E;
+        bandShift = (iter%2==1);
+        if(!resume && (params.schedule == Parameters::GAIN ||
+                       (params.schedule == Parameters::PRIORITY &&
+                        !workers.empty()))) {
+            for(int i=0; i<dispSize; i++) permutation[i] = i;
+            std::sort(permutation, permutation+dispSize, ScoreGreater(score));
+        } else if((iter==0 || params.bRandomizeEveryIteration) && !resume) {
+            for(int i=0; i<dispSize; i++) permutation[i] = i;
+            shuffle(permutation, dispSize);
+        }
+
+        int skipped=0; // number of moves proved useless
+        int index = resume? state.index: 0;
+        if(! workers.empty())
+            step += SpeculativeIteration(permutation, index, done, nDone,
+                                         score, workers, t0);
+        for(; index<dispSize && workers.empty(); index++) {
+            if(past_deadline())
+                break;
+            int label = (params.schedule == Parameters::PRIORITY)?
+                best_label(score, done, dispSize): permutation[index];
+            if(label<0) break;
             if(done[label]) continue;
             ++step;
 
-            if( ExpansionMove(dispMin+label) ) {
-                std::fill_n(done, dispSize, false);
-                nDone = dispSize;
-                std::cout << '*';
-            } else
-                std::cout << '-';
-            std::cout << std::flush;
-            done[label] = true;
-            --nDone;
+            int moveE = E;
+            char result; // Display of move: skipped, accepted or rejected
+            MoveResult move = REJECTED;
+            if((nOccNotOptimal==0 || (nOccNotOptimal==1 && !occOptimal[label]))
+               && ExpansionCannotDecrease(dispMin+label)) {
+                ++skipped;
+                result = '.';
+            } else if((move=ExpansionMove(dispMin+label)) == ABORTED) {
+                // Not solved: the label stays to try, at index if resumed
+                --step;
+                if(E<moveE) { // Some bands were accepted
+                    nDone = invalidate_done(done, dispMin+label);
+                    std::fill_n(occOptimal, dispSize, false);
+                    nOccNotOptimal = dispSize;
+                }
+                break;
+            } else if(move == ACCEPTED) {
+                nDone = invalidate_done(done, dispMin+label);
+                result = '*';
+                if(fullMoves) { // Optimal for occlusions at d!=a
+                    std::fill_n(occOptimal, dispSize, true);
+                    occOptimal[label] = false;
+                    nOccNotOptimal = 1;
+                } else {
+                    std::fill_n(occOptimal, dispSize, false);
+                    nOccNotOptimal = dispSize;
+                }
+            } else {
+                result = '-';
+                if(fullMoves) {
+                    std::fill_n(occOptimal, label, true);
+                    std::fill(occOptimal+label+1, occOptimal+dispSize, true);
+                    nOccNotOptimal = occOptimal[label]? 0: 1;
+                }
+            }
+            if(progress)
+                progress->move(index, dispMin+label, result, E, wall_time()-t0);
+            if(score)
+                score[label] = 0.5f*(score[label] + (float)(moveE-E));
+            if(! done[label]) {
+                done[label] = true;
+                --nDone;
+            }
+            if(!checkpointFile.empty() &&
+               wall_time()-tCheckpoint >= checkpointPeriod) {
+                SaveCheckpoint(iter, index+1, step, oldE, false,
+                               permutation, done, occOptimal, score);
+                tCheckpoint = wall_time();
+            }
         }
-        std::cout << " E=" << E << std::endl;
+        if(progress)
+            progress->iteration(iter, E, oldE, skipped, wall_time()-t0);
+        stop = converged(oldE);
+        if(!checkpointFile.empty() && past_deadline())
+            SaveCheckpoint(iter, index, step, oldE, false,
+                           permutation, done, occOptimal, score);
+        else if(! checkpointFile.empty())
+            SaveCheckpoint(iter+1, 0, step, E, stop,
+                           permutation, done, occOptimal, score);
+        tCheckpoint = wall_time();
     }
 
-    std::cout << (float)step/dispSize << " iterations" << std::endl;
+    if(progress) { // 1 number after decimal separator
+        std::ostringstream s;
+        s << std::fixed << std::setprecision(1)
+          << (float)step/nLabels << " iterations";
+        progress->info(s.str());
+    }
 
+    for(size_t i=0; i<workers.size(); i++)
+        delete workers[i];
     delete [] permutation;
+    delete [] score;
     delete [] done;
+    delete [] occOptimal;
+}
+
+/// Minimal fraction of matched pixels at a label in use (see RunLabelSteps).
+static const int LABEL_USE_DENOM=200;
+
+/// Run alpha-expansions (see run) on every params.labelStep-th disparity,
+/// for at most 2 iterations as they only locate the disparities, then on
+/// disparities at distance less than params.labelStep of the ones in use,
+/// since most of the range of disparities is usually empty. A disparity is
+/// in use if at least 1/LABEL_USE_DENOM of matched pixels have it, to ignore
+/// the few pixels matched by chance at most labels.
+void Match::RunLabelSteps() {
+    const int dispSize = dispMax-dispMin+1, s = params.labelStep;
+    activeLabels = new bool[dispSize];
+    for(int i=0; i<dispSize; i++)
+        activeLabels[i] = (i%s==0);
+    const int maxIter = params.maxIter;
+    params.maxIter = std::min(maxIter, 2);
+    run();
+    params.maxIter = maxIter;
+
+    std::vector<int> count(dispSize,0); // Number of pixels at label
+    int matched=0;
+    RectIterator end=rectEnd(imSizeL);
+    for(RectIterator p=rectBegin(imSizeL); p!=end; ++p)
+        if(IMREF(d_left,*p)!=OCCLUDED) {
+            ++count[IMREF(d_left,*p)-dispMin];
+            ++matched;
+        }
+    int n=0; // Number of labels of refinement
+    for(int i=0; i<dispSize; i++) {
+        activeLabels[i] = false;
+        for(int j=std::max(0,i-s+1); j<dispSize && j<i+s; j++)
+            if(count[j]>0 && count[j]*LABEL_USE_DENOM>=matched)
+                activeLabels[i] = true;
+        if(activeLabels[i])
+            ++n;
+    }
+    if(progress) {
+        std::ostringstream s;
+        s << "Refinement on " << n << " labels";
+        progress->info(s.str());
+    }
+    if(n>0)
+        run();
+
+    delete [] activeLabels;
+    activeLabels = 0;
 }
 
 /// Main algorithm
@@ -273,18 +1137,61 @@ void Match::KZ2() {
         exit(1);
     }
 
-    std::string strDenom; // Denominator as output string
-    if(params.denominator!=1) {
+    if(progress) {
+        std::string strDenom; // Denominator as output string
+        if(params.denominator!=1) {
+            std::ostringstream s;
+            s << params.denominator;
+            strDenom = "/" + s.str();
+        }
         std::ostringstream s;
-        s << params.denominator;
-        strDenom = "/" + s.str();
+        s << "KZ2:  K=" << params.K << strDenom << '\n'
+          << "      edgeThreshold=" << params.edgeThresh
+          << ", lambda1=" << params.lambda1 << strDenom
+          << ", lambda2=" << params.lambda2 << strDenom
+          << ", dataCost = " <<
+            ((params.dataCost==Parameters::L1)? "L1":
+             (params.dataCost==Parameters::L2)? "L2": "census");
+        if(params.schedule != Parameters::RANDOM)
+            s << '\n' << "      schedule=" <<
+                ((params.schedule==Parameters::GAIN)? "gain": "priority");
+        if(params.regionHalo>=0)
+            s << '\n' << "      active region moves, halo="
+              << params.regionHalo;
+        if(params.pyramidLevels>1)
+            s << '\n' << "      pyramid levels=" << params.pyramidLevels;
+        if(params.rangeWidth>1)
+            s << '\n' << "      range moves, width=" << params.rangeWidth;
+        else if(params.labelStep>1)
+            s << '\n' << "      label step=" << params.labelStep;
+        progress->info(s.str());
     }
-    std::cout << "KZ2:  K=" << params.K << strDenom <<std::endl
-              << "      edgeThreshold=" << params.edgeThresh
-              << ", lambda1=" << params.lambda1 << strDenom
-              << ", lambda2=" << params.lambda2 << strDenom
-              << ", dataCost = L" <<
-        ((params.dataCost==Parameters::L1)? '1': '2') << std::endl;
 
-    run();
+    if(params.deadline>0 && deadline==0) // Not set by a caller Match
+        deadline = wall_time() + 0.001*params.deadline;
+
+    if(params.memoryBudget>0)
+        RunTiles();
+    else {
+        // No initialization when resuming from a checkpoint
+        if(params.pyramidLevels>1 && !resumed)
+            InitFromCoarse();
+        else if(params.bSGM && !resumed) { // At coarsest level of pyramid only
+            const double t0 = wall_time();
+            InitSGM();
+            if(progress) {
+                std::ostringstream s;
+                s << "SGM done t=" << (int)(1000*(wall_time()-t0)) << "ms";
+                progress->info(s.str());
+            }
+        }
+        if(params.rangeWidth>1)
+            RunRanges();
+        else if(params.labelStep>1)
+            RunLabelSteps();
+        else
+            run();
+    }
+    if(progress && past_deadline())
+        progress->info("Deadline reached");
 }
@@ -17,9 +17,15 @@
 
 #include "match.h"
 #include "cmdLine.h"
+#include "progress.h"
+#include "timer.h"
 #include <limits>
 #include <cmath>
+#include <cstdio>
+#include <cstring>
 #include <ctime>
+#include <sstream>
+#include <vector>
 
 /// Max denominator for fractions. We need to approximate float values as
 /// fractions since the max-flow is implemented using short integers. The
@@ -51,6 +57,36 @@ void convert_gray(GeneralImage& im) {
     im = (GeneralImage)g;
 }
 
+/// Check that \a pattern has exactly one integer conversion %d, possibly with
+/// zero padding and width (%03d), and no other % except %%. Otherwise, the
+/// pattern could not safely be given to snprintf.
+static bool frame_pattern(const char* pattern) {
+    int n=0;
+    for(const char* p=pattern; *p; p++) {
+        if(*p != '%')
+            continue;
+        if(*++p == '%')
+            continue;
+        if(*p == '0')
+            ++p;
+        while('0'<=*p && *p<='9')
+            ++p;
+        if(*p != 'd' || ++n>1)
+            return false;
+    }
+    return (n==1);
+}
+
+/// Name of frame \a i of a sequence, from printf-like \a pattern (such as
+/// left%03d.png). If i<0, this is the pattern itself (not a sequence).
+static std::string frame_name(const char* pattern, int i) {
+    if(i<0)
+        return pattern;
+    std::vector<char> name(std::strlen(pattern)+32);
+    snprintf(&name[0], name.size(), pattern, i);
+    return &name[0];
+}
+
 /// Store in \a params fractions approximating the last 3 parameters.
 ///
 /// They have the same denominator (up to \c MAX_DENOM), chosen so that the sum
@@ -79,14 +115,16 @@ void set_fractions(Match::Parameters& params,
 
 /// Make sure parameters K, lambda1 and lambda2 are non-negative.
 ///
-/// - K may be computed automatically and lambda set to K/5.
+/// - K may be computed automatically and lambda set to K/5. If kSamples>0,
+///   K is estimated from a subset of pixels (see Match::GetK).
 /// - lambda1=3*lambda, lambda2=lambda
 /// As the graph requires integer weights, use fractions and common denominator.
 void fix_parameters(Match& m, Match::Parameters& params,
-                    float& K, float& lambda, float& lambda1, float& lambda2) {
+                    float& K, float& lambda, float& lambda1, float& lambda2,
+                    float kSamples) {
     if(K<0) { // Automatic computation of K
         m.SetParameters(&params);
-        K = m.GetK();
+        K = m.GetK(kSamples);
     }
     if(lambda<0) // Set lambda to K/5
         lambda = K/5;
@@ -102,17 +140,54 @@ int main(int argc, char *argv[]) {
         Match::Parameters::L2, 1, // dataCost, denominator
         8, -1, -1, // edgeThresh, lambda1, lambda2 (smoothness cost)
         -1,        // K (occlusion cost)
-        4, false   // maxIter, bRandomizeEveryIteration
+        4, false,  // maxIter, bRandomizeEveryIteration
+        Match::Parameters::RANDOM, // schedule
+        -1, false, // regionHalo, bLocalDone
+        1, 0,      // pyramidLevels, memoryBudget
+        1, 1,      // bands, speculative
+        1, 1,      // rangeWidth, labelStep
+        0,         // deadline
+        0, false,  // tolerance, bRelativeTolerance
+        false,     // bSGM
+        false      // bCostVolume
     };
 
     CmdLine cmd;
-    std::string cost, sDisp;
-    float K=-1, lambda=-1, lambda1=-1, lambda2=-1;
+    std::string cost, sDisp, cacheDir, schedule, tolerance, sInit;
+    std::string checkpoint;
+    float checkpointPeriod=60;
+    unsigned int seed=0;
+    int nFrames=0, firstFrame=0, frameIter=1;
+    float K=-1, lambda=-1, lambda1=-1, lambda2=-1, kSamples=0;
     cmd.add( make_option('i', params.maxIter, "max_iter") );
     cmd.add( make_option('o', sDisp, "output") );
+    cmd.add( make_option(0, sInit, "init") );
+    cmd.add( make_switch(0, "sgm") );
     cmd.add( make_switch('r', "random") );
+    cmd.add( make_option(0, schedule, "schedule") );
+    cmd.add( make_option(0, params.regionHalo, "region") );
+    cmd.add( make_switch(0, "local_done") );
+    cmd.add( make_option(0, params.pyramidLevels, "pyramid") );
+    cmd.add( make_option('m', params.memoryBudget, "memory") );
+    cmd.add( make_option(0, params.bands, "bands") );
+    cmd.add( make_option(0, params.speculative, "speculative") );
+    cmd.add( make_option(0, params.rangeWidth, "range") );
+    cmd.add( make_option(0, params.labelStep, "label_step") );
+    cmd.add( make_option(0, params.deadline, "deadline") );
+    cmd.add( make_option(0, tolerance, "tolerance") );
+    cmd.add( make_option(0, seed, "seed") );
+    cmd.add( make_option(0, nFrames, "frames") );
+    cmd.add( make_option(0, firstFrame, "first_frame") );
+    cmd.add( make_option(0, frameIter, "frame_iter") );
+    cmd.add( make_switch('v', "cost_volume") );
+    cmd.add( make_option(0, cacheDir, "cache") );
+    cmd.add( make_option(0, checkpoint, "checkpoint") );
+    cmd.add( make_option(0, checkpointPeriod, "checkpoint_period") );
+    cmd.add( make_switch(0, "resume") );
+    cmd.add( make_switch('q', "quiet") );
     cmd.add( make_option('c', cost, "data_cost") );
     cmd.add( make_option('k', K) );
+    cmd.add( make_option(0, kSamples, "k_samples") );
     cmd.add( make_option('l', lambda, "lambda") );
     cmd.add( make_option(0, lambda1, "lambda1") );
     cmd.add( make_option(0, lambda2, "lambda2") );
@@ -125,33 +200,170 @@ int main(int argc, char *argv[]) {
         std::cerr << "General options:" << '\n'
                   << " -i,--max_iter iter: max number of iterations" <<'\n'
                   << " -o,--output disp.png: scaled disparity map" <<'\n'
+                  << " --init disp.tif: initial disparity map (TIFF or PFM,"
+                  << " NaN for occlusion)" <<'\n'
+                  << " --sgm: initial disparity map by semi-global matching"
+                  <<'\n'
                   << " -r,--random: random alpha order at each iteration" <<'\n'
+                  << " --schedule s: order of alpha, random, gain or priority"
+                  <<'\n'
+                  << " --region halo: restrict moves to pixels where alpha is"
+                  << " competitive, plus halo" <<'\n'
+                  << " --local_done: after a move, retry only alpha viable"
+                  << " near changed pixels" <<'\n'
+                  << " --pyramid levels: coarse-to-fine, searching"
+                  << " disparity near coarse one" <<'\n'
+                  << " -m,--memory MB: memory budget, by bands of rows"
+                  << " solved in parallel (the full image needs up to 28"
+                  << " bytes per pixel more)" <<'\n'
+                  << " --bands n: alpha-expansion by n bands of rows in"
+                  << " parallel" <<'\n'
+                  << " --speculative n: n alpha-expansions in parallel, then"
+                  << " fused" <<'\n'
+                  << " --range r: moves to any of r consecutive disparities"
+                  << " instead of alpha-expansions" <<'\n'
+                  << " --label_step s: expansions on every s-th disparity,"
+                  << " then near used ones" <<'\n'
+                  << " --deadline ms: stop moves after ms milliseconds"
+                  <<'\n'
+                  << " --tolerance eps[%]: stop when an iteration decreases"
+                  << " energy by less than eps" <<'\n'
+                  << " --seed s: seed of random generator (default: time)"
+                  <<'\n'
+                  << " --frames n: video of n frames, file names being"
+                  << " printf patterns (left%03d.png)" <<'\n'
+                  << " --first_frame i: index of first frame (default: 0)"
+                  <<'\n'
+                  << " --frame_iter iter: max number of iterations of next"
+                  << " frames (default: 1)" <<'\n'
+                  << " -v,--cost_volume: precompute data costs (uses 2 bytes"
+                  << " per pixel and disparity)" <<'\n'
+                  << " --cache dir: read/write cost volume (implies -v) in dir"
+                  << " (first frame only)" <<'\n'
+                  << " --checkpoint file: save state of algorithm to file"
+                  << " after each iteration" <<'\n'
+                  << " --checkpoint_period s: and every s seconds during"
+                  << " iterations (default: 60)" <<'\n'
+                  << " --resume: continue from checkpoint file, if any"
+                  <<'\n'
+                  << " -q,--quiet: no display of progress" <<'\n'
                   << "Options for cost:" <<'\n'
-                  << " -c,--data_cost dist: L1 or L2" <<'\n'
+                  << " -c,--data_cost dist: L1, L2 or census" <<'\n'
                   << " -l,--lambda lambda: value of lambda (smoothness)" <<'\n'
                   << " --lambda1 l1: smoothness cost not across edge" <<'\n'
                   << " --lambda2 l2: smoothness cost across edge" <<'\n'
                   << " -t,--threshold thres: intensity diff for 'edge'" <<'\n'
-                  << " -k k: cost for occlusion" <<std::endl;
+                  << " -k k: cost for occlusion" <<'\n'
+                  << " --k_samples s: estimate K from a fraction (s<=1) or a"
+                  << " number (s>1) of pixels" <<std::endl;
         return 1;
     }
 
     if( cmd.used('r') ) params.bRandomizeEveryIteration=true;
+    if( cmd.used(std::string("local_done")) ) params.bLocalDone=true;
+    if( cmd.used(std::string("sgm")) ) params.bSGM=true;
+    if( cmd.used('v') || !cacheDir.empty() ) params.bCostVolume=true;
+    if(params.pyramidLevels<1) {
+        std::cerr << "The number of pyramid levels must be positive"
+                  << std::endl;
+        return 1;
+    }
+    if(!sInit.empty() && params.pyramidLevels>1) {
+        std::cerr << "Options --init and --pyramid are incompatible"
+                  << std::endl;
+        return 1;
+    }
+    if(!sInit.empty() && params.bSGM) {
+        std::cerr << "Options --init and --sgm are incompatible"
+                  << std::endl;
+        return 1;
+    }
+    const bool resume = cmd.used(std::string("resume"));
+    if(resume && checkpoint.empty()) {
+        std::cerr << "Option --resume requires --checkpoint" << std::endl;
+        return 1;
+    }
+    if(!checkpoint.empty() && (params.memoryBudget>0 || params.rangeWidth>1
+                               || params.labelStep>1 || nFrames>0
+                               || params.pyramidLevels>1)) {
+        std::cerr << "Option --checkpoint is incompatible with --memory,"
+                  << " --range, --label_step, --frames and --pyramid"
+                  << std::endl;
+        return 1;
+    }
+    if(resume && !sInit.empty()) {
+        std::cerr << "Options --init and --resume are incompatible"
+                  << std::endl;
+        return 1;
+    }
+    if(nFrames<0 || frameIter<0) {
+        std::cerr << "The number of frames and their iterations must be"
+                  << " non-negative" << std::endl;
+        return 1;
+    }
+    if(nFrames>0) {
+        std::vector<const char*> patterns(argv+1, argv+3);
+        if(argc>5)
+            patterns.push_back(argv[5]);
+        if(! sDisp.empty())
+            patterns.push_back(sDisp.c_str());
+        for(size_t i=0; i<patterns.size(); i++)
+            if(! frame_pattern(patterns[i])) {
+                std::cerr << "File name " << patterns[i] << " must have one"
+                          << " integer conversion %d (or %03d...) and no"
+                          << " other % but %%" << std::endl;
+                return 1;
+            }
+    }
+    if(params.memoryBudget<0) {
+        std::cerr << "The memory budget must be non-negative" << std::endl;
+        return 1;
+    }
+    if(! schedule.empty()) {
+        if(schedule == "random")
+            params.schedule = Match::Parameters::RANDOM;
+        else if(schedule == "gain")
+            params.schedule = Match::Parameters::GAIN;
+        else if(schedule == "priority")
+            params.schedule = Match::Parameters::PRIORITY;
+        else {
+            std::cerr << "The schedule must be 'random', 'gain' or 'priority'"
+                      << std::endl;
+            return 1;
+        }
+    }
+    if(! tolerance.empty()) {
+        std::istringstream s(tolerance);
+        char percent=0;
+        if(!(s >> params.tolerance) || params.tolerance<0 ||
+           ((s >> percent) && percent!='%') || (s >> percent)) {
+            std::cerr << "The tolerance must be a non-negative number,"
+                      << " possibly followed by %" << std::endl;
+            return 1;
+        }
+        params.bRelativeTolerance = (percent=='%');
+    }
     if( cmd.used('c') ) {
         if(cost == "L1")
             params.dataCost = Match::Parameters::L1;
         else if(cost == "L2")
             params.dataCost = Match::Parameters::L2;
+        else if(cost == "census")
+            params.dataCost = Match::Parameters::CENSUS;
         else {
-            std::cerr << "The cost parameter must be 'L1' or 'L2'" << std::endl;
+            std::cerr << "The cost parameter must be 'L1', 'L2' or 'census'"
+                      << std::endl;
             return 1;
         }
     }
 
-    GeneralImage im1 = (GeneralImage)imLoad(IMAGE_RGB, argv[1]);
-    GeneralImage im2 = (GeneralImage)imLoad(IMAGE_RGB, argv[2]);
+    const int frame0 = (nFrames>0)? firstFrame: -1; // -1: not a video
+    std::string name1=frame_name(argv[1],frame0);
+    std::string name2=frame_name(argv[2],frame0);
+    GeneralImage im1 = (GeneralImage)imLoad(IMAGE_RGB, name1.c_str());
+    GeneralImage im2 = (GeneralImage)imLoad(IMAGE_RGB, name2.c_str());
     if(!im1 || !im2) {
-        std::cerr << "Unable to read image " << argv[im1?2:1] << std::endl;
+        std::cerr << "Unable to read image " << (im1?name2:name1) << std::endl;
         return 1;
     }
     bool color=true;
@@ -160,7 +372,11 @@ int main(int argc, char *argv[]) {
         convert_gray(im1);
         convert_gray(im2);
     }
+    const bool quiet = cmd.used('q');
+    ConsoleProgress console;
     Match m(im1, im2, color);
+    m.SetProgress(quiet? 0: &console);
+    m.SetCacheDir(cacheDir);
 
     // Disparity
     int dMin=0, dMax=0;
@@ -171,17 +387,65 @@ int main(int argc, char *argv[]) {
     }
     m.SetDispRange(dMin, dMax);
 
-    time_t seed = time(NULL);
-    srand((unsigned int)seed);
+    if(! cmd.used(std::string("seed")))
+        seed = (unsigned int)time(NULL);
+    srand(seed);
 
-    fix_parameters(m, params, K, lambda, lambda1, lambda2);
-    if(argc>5 || !sDisp.empty()) {
+    fix_parameters(m, params, K, lambda, lambda1, lambda2, kSamples);
+    if(! sInit.empty()) {
+        FloatImage init = (FloatImage)imLoad(IMAGE_FLOAT, sInit.c_str());
+        if(! init) {
+            std::cerr << "Unable to read image " << sInit << std::endl;
+            return 1;
+        }
+        int n = m.InitDisparity(init);
+        if(n>0 && !quiet)
+            std::cout << "Initial disparity map: " << n
+                      << " pixels occluded for uniqueness" << std::endl;
+        imFree(init);
+    }
+    if(m.SetCheckpoint(checkpoint, checkpointPeriod, resume) && !quiet)
+        std::cout << "Resuming from checkpoint " << checkpoint << std::endl;
+    // Next frames of video start from the disparity map of the previous one
+    for(int i=0; (argc>5 || !sDisp.empty()) && (i==0 || i<nFrames); i++) {
+        const int frame = (frame0<0)? -1: frame0+i;
+        const double t0 = wall_time();
+        if(i>0) {
+            name1 = frame_name(argv[1],frame);
+            name2 = frame_name(argv[2],frame);
+            GeneralImage next1 = (GeneralImage)imLoad(IMAGE_RGB,name1.c_str());
+            GeneralImage next2 = (GeneralImage)imLoad(IMAGE_RGB,name2.c_str());
+            if(!next1 || !next2) {
+                std::cerr << "Unable to read image " << (next1?name2:name1)
+                          << std::endl;
+                return 1;
+            }
+            if(! color) {
+                convert_gray(next1);
+                convert_gray(next2);
+            }
+            m.SetImagePair(next1, next2);
+            imFree(im1);
+            imFree(im2);
+            im1 = next1;
+            im2 = next2;
+            if(i==1) { // Same data term, but warm start at full resolution
+                params.maxIter = frameIter;
+                params.pyramidLevels = 1;
+                params.bSGM = false;
+                m.SetParameters(&params);
+            }
+        }
         m.KZ2();
+        if(frame>=0 && !quiet)
+            std::cout << "Frame " << frame << " t="
+                      << (int)(1000*(wall_time()-t0)) << "ms" << std::endl;
         if(argc>5)
-            m.SaveXLeft(argv[5]);
+            m.SaveXLeft(frame_name(argv[5],frame).c_str());
         if(! sDisp.empty())
-            m.SaveScaledXLeft(sDisp.c_str(), false);
-    } else {
+            m.SaveScaledXLeft(frame_name(sDisp.c_str(),frame).c_str(), false);
+    }
+    if(argc<=5 && sDisp.empty()) {
         std::cout << "K=" << K << std::endl;
         std::cout << "lambda=" << lambda << std::endl;
     }
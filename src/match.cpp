@@ -21,8 +21,10 @@
 #include <algorithm>
 #include <limits>
 #include <iostream>
+#include <vector>
+#include <cmath>
 
-const int Match::OCCLUDED = std::numeric_limits<int>::max();
+const int Match::OCCLUDED = std::numeric_limits<short>::max();
 
 /// Constructor
 Match::Match(GeneralImage left, GeneralImage right, bool color) {
@@ -50,30 +52,96 @@ Match::Match(GeneralImage left, GeneralImage right, bool color) {
         imColorRightMin = imColorRightMax = 0;
     }
 
+    censusLeft = censusRight = 0;
+
     dispMin = dispMax = 0;
+    costVolume = 0;
+    costVolumeType = -1;
+    costVolumeMap = 0;
+    costVolumeMapSize = 0;
+    checkpointPeriod = 0;
+    resumed = 0;
 
-    d_left  = (IntImage)imNew(IMAGE_INT, imSizeL);
-    vars0 = (IntImage)imNew(IMAGE_INT, imSizeL);
-    varsA = (IntImage)imNew(IMAGE_INT, imSizeL);
-    if (!d_left || !vars0 || !varsA)
+    d_left  = (ShortImage)imNew(IMAGE_SHORT, imSizeL);
+    vars = (Int2Image)imNew(IMAGE_INT2, imSizeL);
+    checkedDisp = 0;
+    pixelE = 0;
+    checkedE = 0;
+    region = 0;
+    dispLo = dispHi = 0;
+    fixedTop = fixedBottom = 0;
+    progress = 0;
+    bandShift = false;
+    owner = true;
+    activeLabels = 0;
+    deadline = 0;
+    randomState = 0;
+    if (!d_left || !vars)
         { std::cerr << "Not enough memory!" << std::endl; exit(1); }
 }
 
+/// Copy sharing the images, data term and windows of m, which must outlive
+/// it. The disparity map is copied and the other images are its own, so that
+/// both can compute alpha-expansions concurrently (see SpeculativeIteration).
+Match::Match(const Match& m)
+: imSizeL(m.imSizeL), imSizeR(m.imSizeR), originalHeightL(m.originalHeightL),
+  imLeft(m.imLeft), imRight(m.imRight),
+  imColorLeft(m.imColorLeft), imColorRight(m.imColorRight),
+  imLeftMin(m.imLeftMin), imLeftMax(m.imLeftMax),
+  imRightMin(m.imRightMin), imRightMax(m.imRightMax),
+  imColorLeftMin(m.imColorLeftMin), imColorLeftMax(m.imColorLeftMax),
+  imColorRightMin(m.imColorRightMin), imColorRightMax(m.imColorRightMax),
+  censusLeft(m.censusLeft), censusRight(m.censusRight),
+  dispMin(m.dispMin), dispMax(m.dispMax),
+  costVolume(m.costVolume), costVolumeType(m.costVolumeType),
+  costVolumeMap(0), costVolumeMapSize(0), cacheDir(m.cacheDir),
+  checkpointPeriod(0), resumed(0),
+  params(m.params), E(m.E), checkedDisp(0), pixelE(0), checkedE(0),
+  region(0), dispLo(m.dispLo), dispHi(m.dispHi),
+  fixedTop(m.fixedTop), fixedBottom(m.fixedBottom),
+  progress(0), bandShift(m.bandShift), owner(false),
+  activeLabels(m.activeLabels), deadline(m.deadline), randomState(0) {
+    d_left = (ShortImage)imNew(IMAGE_SHORT, imSizeL);
+    vars = (Int2Image)imNew(IMAGE_INT2, imSizeL);
+    if (!d_left || !vars)
+        { std::cerr << "Not enough memory!" << std::endl; exit(1); }
+    RectIterator end=rectEnd(imSizeL);
+    for(RectIterator p=rectBegin(imSizeL); p!=end; ++p)
+        IMREF(d_left,*p) = IMREF(m.d_left,*p);
+}
+
 /// Destructor
 Match::~Match() {
-    imFree(imLeftMin);
-    imFree(imLeftMax);
-    imFree(imRightMin);
-    imFree(imRightMax);
-    imFree(imColorLeftMin);
-    imFree(imColorLeftMax);
-    imFree(imColorRightMin);
-    imFree(imColorRightMax);
+    if(owner) {
+        imFree(imLeftMin);
+        imFree(imLeftMax);
+        imFree(imRightMin);
+        imFree(imRightMax);
+        imFree(imColorLeftMin);
+        imFree(imColorLeftMax);
+        imFree(imColorRightMin);
+        imFree(imColorRightMax);
+        imFree(censusLeft);
+        imFree(censusRight);
+
+        FreeCostVolume();
+
+        imFree(dispLo);
+        imFree(dispHi);
+    }
 
+    delete resumed;
     imFree(d_left);
 
-    imFree(vars0);
-    imFree(varsA);
+    imFree(vars);
+    imFree(region);
+    FreeEnergyCheck();
+}
+
+/// Set receiver of progress of KZ2 (NULL for none). It must outlive the
+/// computations.
+void Match::SetProgress(Progress* p) {
+    progress = p;
 }
 
 /// Save disparity map as float TIFF image
@@ -133,7 +201,112 @@ void Match::SetDispRange(int dMin, int dMax) {
         std::cerr << "Error: wrong disparity range!\n" << std::endl;
         exit(1);
     }
+    if (dispMin<std::numeric_limits<short>::min() || dispMax>=OCCLUDED) {
+        std::cerr << "Error: disparities must fit in 16 bits" << std::endl;
+        exit(1);
+    }
+    if(costVolume) { // Depends on disparity range
+        FreeCostVolume();
+        InitDataCost();
+    }
     RectIterator end=rectEnd(imSizeL);
     for(RectIterator p=rectBegin(imSizeL); p!=end; ++p)
         IMREF(d_left, *p) = OCCLUDED;
 }
+
+/// Replace the image pair by the next frame of a video, of same sizes and
+/// type (gray or color) as the former one. The buffers of the data term are
+/// recomputed in place. The cache of cost volumes is no longer used, as
+/// frames are processed once. The disparity map is kept as
+/// initialization of the next KZ2, after enforcing the uniqueness constraint
+/// for the new data term (see enforce_uniqueness). Return the number of
+/// pixels occluded for it.
+int Match::SetImagePair(GeneralImage left, GeneralImage right) {
+    if(imGetXSize(left)!=imSizeL.x || imGetYSize(left)!=originalHeightL ||
+       imGetXSize(right)!=imSizeR.x ||
+       std::min(imGetYSize(left),imGetYSize(right))!=imSizeL.y) {
+        std::cerr << "Error: image pair of different size!" << std::endl;
+        exit(1);
+    }
+    if(imLeft) {
+        imLeft  = (GrayImage)left;
+        imRight = (GrayImage)right;
+    } else {
+        imColorLeft  = (RGBImage)left;
+        imColorRight = (RGBImage)right;
+    }
+
+    if(imLeftMin || imColorLeftMin)
+        InitSubPixel(true);
+    if(censusLeft)
+        InitCensus(true);
+    cacheDir.clear(); // Frames are processed once
+    if(costVolume) {
+        if(costVolumeMap) { // Data term of former images not computed
+            FreeCostVolume();
+            InitDataCost();
+        } else
+            InitCostVolume();
+    }
+
+    if(dispLo) { // Windows of former images, see InitFromCoarse
+        imFree(dispLo);
+        imFree(dispHi);
+        imFree(region); // Restricting moves to the windows
+        dispLo = dispHi = 0;
+        region = 0;
+    }
+    deadline = 0;
+    FreeEnergyCheck(); // Data term changed
+    return enforce_uniqueness();
+}
+
+/// Initialize the disparity map from \a disp, rounded to nearest integers.
+/// NaN values and those out of the disparity range or matching outside the
+/// right image are occlusions. The uniqueness constraint is then enforced
+/// (see enforce_uniqueness). Call after SetDispRange and SetParameters.
+/// Return the number of pixels occluded for uniqueness.
+int Match::InitDisparity(FloatImage disp) {
+    if(imGetXSize(disp)!=imSizeL.x || imGetYSize(disp)!=originalHeightL) {
+        std::cerr << "Error: initial disparity map of wrong size!" << std::endl;
+        exit(1);
+    }
+    RectIterator end=rectEnd(imSizeL);
+    for(RectIterator p=rectBegin(imSizeL); p!=end; ++p) {
+        const float f = floor(IMREF(disp,*p)+0.5f); // NaN if disp is NaN
+        int d = OCCLUDED;
+        if(is_number(f) && dispMin<=f && f<=dispMax) // Before int conversion
+            d = (int)f;
+        if(d!=OCCLUDED && !inRect(*p+d,imSizeR))
+            d = OCCLUDED;
+        IMREF(d_left,*p) = d;
+    }
+    return enforce_uniqueness();
+}
+
+/// Among pixels of d_left with the same match, keep only the one of lowest
+/// data cost, the others being occluded. Return the number of pixels
+/// occluded.
+int Match::enforce_uniqueness() {
+    int n=0;
+    std::vector<int> claim(imSizeR.x); // Left pixel matched to right one
+    for(Coord p(0,0); p.y<imSizeL.y; p.y++) {
+        std::fill(claim.begin(), claim.end(), -1);
+        for(p.x=0; p.x<imSizeL.x; p.x++) {
+            const int d = IMREF(d_left,p);
+            if(d==OCCLUDED) continue;
+            int& x = claim[p.x+d];
+            if(x>=0) {
+                Coord q(x,p.y); // Pixel with same match
+                ++n;
+                if(data_penalty(q,p+d) <= data_penalty(p,p+d)) {
+                    IMREF(d_left,p) = OCCLUDED;
+                    continue;
+                }
+                IMREF(d_left,q) = OCCLUDED;
+            }
+            x = p.x;
+        }
+    }
+    return n;
+}
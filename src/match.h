@@ -20,7 +20,10 @@
 #define MATCH_H
 
 #include "image.h"
+#include <string>
+#include <vector>
 class Energy;
+class Progress;
 
 /// Main class for Kolmogorov-Zabih algorithm
 class Match {
@@ -29,11 +32,13 @@ public:
     ~Match();
 
     void SetDispRange(int dMin, int dMax);
+    int InitDisparity(FloatImage disp);
+    int SetImagePair(GeneralImage left, GeneralImage right);
 
     /// Parameters of algorithm.
     struct Parameters
     {
-        enum { L1, L2 } dataCost; ///< Data term
+        enum { L1, L2, CENSUS } dataCost; ///< Data term
         /// Data term must be multiplied by denominator.
         /// Equivalent to using lambda1/denom, lambda2/denom, K/denom
         int denominator;
@@ -46,16 +51,47 @@ public:
 
         int maxIter; ///< Maximum number of iterations
         bool bRandomizeEveryIteration; ///< Random alpha order at each iter
-
+        enum { RANDOM, GAIN, PRIORITY } schedule; ///< Order of alpha (see run)
+        /// Restrict moves to pixels where alpha is competitive, plus a halo
+        /// of this radius (<0: moves involve all pixels)
+        int regionHalo;
+        bool bLocalDone; ///< After a move, retry only labels viable near it
+        /// Number of levels of coarse-to-fine pyramid (1: single scale)
+        int pyramidLevels;
+        /// Memory budget in MB, met by processing bands of rows (0: none)
+        int memoryBudget;
+        int bands; ///< Parallel moves by bands of rows (<=1: whole image)
+        /// Number of alpha-expansions computed in parallel, then fused
+        /// (<=1: sequential expansions)
+        int speculative;
+        int rangeWidth; ///< Width of range moves (<=1: alpha-expansions)
+        /// Expansions on every labelStep-th disparity first, then near the
+        /// ones in use (<=1: all disparities)
+        int labelStep;
+        int deadline; ///< Wall-clock budget in ms, moves stop after (0: none)
+        /// Stop when an iteration decreases the energy by less (0: never)
+        float tolerance;
+        bool bRelativeTolerance; ///< tolerance is a percentage of energy
+        bool bSGM; ///< Initialize disparity map by semi-global matching
+
+        bool bCostVolume; ///< Precompute data costs of all disparities
     };
-    float GetK();
+    float GetK(float samples=0);
     void SetParameters(Parameters *params);
+    void SetCacheDir(const std::string& dir);
+    void SetProgress(Progress* p);
+    bool SetCheckpoint(const std::string& file, double period, bool resume);
     void KZ2();
 
     void SaveXLeft(const char *fileName); ///< Save disp. map as float TIFF
     void SaveScaledXLeft(const char *fileName, bool flag); ///< Save colormapped
 
+    static const int CENSUS_RADIUS; ///< Radius of census transform window
+
 private:
+    Match(const Match& m);
+    Match& operator=(const Match&); // Not implemented
+
     Coord imSizeL, imSizeR; ///< image dimensions
     int originalHeightL; ///< true left image height before possible crop
     GrayImage imLeft, imRight;          ///< original images (if gray)
@@ -64,24 +100,82 @@ private:
     GrayImage imRightMin, imRightMax;   ///< range of gray based on neighbors
     RGBImage imColorLeftMin, imColorLeftMax; ///< For color images
     RGBImage imColorRightMin, imColorRightMax;
+    IntImage censusLeft, censusRight; ///< Census transform of images
     int dispMin, dispMax; ///< range of disparities
+    /// Data cost D(p,p+d) at index ((d-dispMin)*height+p.y)*width+p.x,
+    /// NULL if data costs are computed on the fly.
+    const short* costVolume;
+    int costVolumeType; ///< Data cost stored in costVolume
+    void* costVolumeMap; ///< Memory mapped cache file (if costVolume in it)
+    size_t costVolumeMapSize; ///< Size of mapped file
+    std::string cacheDir; ///< Directory of cost volume cache (empty: none)
+    struct Checkpoint;
+    std::string checkpointFile; ///< File of checkpoints of run (empty: none)
+    double checkpointPeriod; ///< Seconds between checkpoints in iteration
+    Checkpoint* resumed; ///< State of run read from checkpoint (NULL: none)
 
     static const int OCCLUDED; ///< Special value of disparity meaning occlusion
+    /// Disparity map, 16-bit since disparities are less than OCCLUDED.
     /// If (p,q) is an active assignment
     /// q == Coord(p.x+IMREF(d_left,p), p.y)
-    IntImage  d_left;
+    ShortImage d_left;
     Parameters  params; ///< Set of parameters
 
     int E; ///< Current energy
-    IntImage vars0; ///< Variables before alpha expansion
-    IntImage varsA; ///< Variables after alpha expansion
+    /// Disparity map and energy terms of each pixel at last CheckEnergy,
+    /// whose sum is checkedE (NULL: not computed)
+    ShortImage checkedDisp;
+    IntImage pixelE;
+    int checkedE;
+    /// Variables of assignments (p,p+d) in A^0 (c[0], before alpha
+    /// expansion) and (p,p+a) in A^a (c[1], after), of a same pixel
+    Int2Image vars;
+    GrayImage region; ///< Pixels free to change in move (NULL: all)
+    Coord changedMin, changedMax; ///< Bounding box of pixels changed by move
+    Coord changedDisp; ///< Range [x,y] of former disparities of these pixels
+    /// Window [dispLo,dispHi] of disparities allowed at each pixel, from the
+    /// coarser level of pyramid (NULL: all disparities)
+    IntImage dispLo, dispHi;
+    int fixedTop, fixedBottom; ///< Numbers of top/bottom rows kept fixed
+    Progress* progress; ///< Receiver of progress of algorithm (NULL: quiet)
+    bool bandShift; ///< Shift separators of bands (see ExpansionMoveBands)
+    bool owner; ///< Images, data term and windows are not shared copies
+    bool* activeLabels; ///< Labels whose expansion is tried (NULL: all)
+    double deadline; ///< Wall-clock time when moves stop (0: none)
+    /// State of own random generator of a band, see SolveTile (0: rand())
+    unsigned long long randomState;
 
     void run();
-    void InitSubPixel();
+    void InitSubPixel(bool update=false);
+    void InitCensus(bool update=false);
+    void InitDataCost();
+    void InitCostVolume();
+    void FreeCostVolume();
+    std::string CostVolumeCacheFile() const;
+    bool LoadCostVolume(const std::string& fileName);
+    void SaveCostVolume(const std::string& fileName) const;
+    void SaveCheckpoint(int iter, int index, int step, int iterE, bool stop,
+                        const int* permutation, const bool* done,
+                        const bool* occOptimal, const float* score) const;
+    int  enforce_uniqueness();
+    void InitFromCoarse();
+    void InitSGM();
+    bool left_edge(Coord p1, Coord p2) const;
+    void sgm_path(Coord p, Coord step, const unsigned short* cost,
+                  unsigned short* sum) const;
+    void RunTiles();
+    void SolveTile(int y0, int y1, bool fixBorders, unsigned int seed);
+    void RunRanges();
+    void RunLabelSteps();
 
     // Data penalty functions
+    int  data_penalty      (Coord l, Coord r) const;
+    int  kth_data_penalty  (Coord l, int k, int* buf) const;
+    float GetKSampled(int k, int n);
+    void wta_gains(float* gain) const;
     int  data_penalty_gray (Coord l, Coord r) const;
     int  data_penalty_color(Coord l, Coord r) const;
+    int  data_penalty_census(Coord l, Coord r) const;
 
     // Smoothness penalty functions
     int  smoothness_penalty_gray (Coord p, Coord np, int d) const;
@@ -90,14 +184,64 @@ private:
     // Kolmogorov-Zabih algorithm
     int  data_occlusion_penalty(Coord l, Coord r) const;
     int  smoothness_penalty(Coord p, Coord np, int d) const;
+    int  pixel_energy(Coord p) const;
     int  ComputeEnergy() const;
-    bool ExpansionMove(int a);
+    bool CheckEnergy();
+    void FreeEnergyCheck();
+    bool past_deadline() const;
+    void shuffle(int* buf, int n);
+    bool converged(int oldE) const;
+    /// Outcome of a move: ABORTED if the deadline passed during its maxflow,
+    /// so that the move was not solved
+    enum MoveResult { REJECTED, ACCEPTED, ABORTED };
+    MoveResult ExpansionMove(int a);
+    MoveResult ExpansionMoveBands(int a);
+    int  SpeculativeIteration(const int* order, int& index,
+                              bool* done, int& nDone,
+                              float* score, std::vector<Match*>& workers,
+                              double t0);
+    MoveResult FusionMove(ShortImage proposal);
+    void range_proposal(int a, int r, ShortImage proposal) const;
+    int  pair_penalty(Coord p1, Coord p2, int d1, int d2) const;
+    bool ExpansionCannotDecrease(int a) const;
+    int  switch_gain(Coord p, int a) const;
+    bool competitive_in(Coord pMin, Coord pMax, int a) const;
+    int  invalidate_done(bool* done, int alpha) const;
 
     // Graph construction
+    bool competitive(Coord p, int a, bool strict=false) const;
+    int  build_region(int a);
+    bool in_region(Coord p) const;
+    bool allowed(Coord p, int a) const;
+    int  var0(Coord p, int a) const;
+    int  varA(Coord p, int a) const;
     void build_nodes        (Energy& e, Coord p, int a);
     void build_smoothness   (Energy& e, Coord p, Coord np, int a);
     void build_uniqueness(Energy& e, Coord p, int a);
-    void update_disparity(const Energy& e, int a);
+    void build_graph(Energy& e, int a, int y0, int y1,
+                     std::vector<int>& varPixel);
+    void update_disparity(const Energy& e, int a,
+                          const std::vector<int>& varPixel);
 };
 
+/// State of Match::run, besides the disparity map, to resume it (see
+/// SetCheckpoint).
+struct Match::Checkpoint {
+    int iter, index; ///< Next move is at index of permutation at iteration
+    int step; ///< Number of moves done
+    int iterE; ///< Energy at start of iteration
+    bool stop; ///< Energy decrease below tolerance at last iteration
+    std::vector<int> permutation; ///< Order of labels
+    std::vector<unsigned char> done, occOptimal; ///< See run
+    std::vector<float> score; ///< Estimated gains (empty for RANDOM)
+};
+
+/// Is disparity a allowed at pixel p? It must not be in a fixed row and be in
+/// the window of the pixel, if any (see InitFromCoarse).
+inline bool Match::allowed(Coord p, int a) const {
+    if(p.y<fixedTop || p.y>=imSizeL.y-fixedBottom)
+        return false;
+    return (!dispLo || (IMREF(dispLo,p)<=a && a<=IMREF(dispHi,p)));
+}
+
 #endif
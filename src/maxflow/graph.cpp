@@ -24,7 +24,7 @@
 template <typename captype, typename tcaptype, typename flowtype>
 Graph<captype, tcaptype, flowtype>::Graph(int hintNbNodes, int hintNbArcs)
 : nodes(), arcs(), flow(0), activeBegin(0),activeEnd(0), orphans(), time(0),
-  TERMINAL(0), ORPHAN(0)
+  abortFunc(0), abortData(0), bAborted(false), TERMINAL(0), ORPHAN(0)
 {
     nodes.reserve(hintNbNodes);
     arcs.reserve(hintNbArcs);
@@ -35,6 +35,13 @@ template <typename captype, typename tcaptype, typename flowtype>
 Graph<captype,tcaptype,flowtype>::~Graph()
 {}
 
+/// Memory in bytes of nodes and arcs of a graph of the given size.
+template <typename captype, typename tcaptype, typename flowtype>
+size_t Graph<captype,tcaptype,flowtype>::memory(int nbNodes, int nbArcs)
+{
+    return (size_t)nbNodes*sizeof(node) + (size_t)nbArcs*sizeof(arc);
+}
+
 /// Add node to the graph. First call returns 0, second 1, and so on.
 template <typename captype, typename tcaptype, typename flowtype>
 typename Graph<captype,tcaptype,flowtype>::node_id
@@ -103,4 +110,18 @@ Graph<captype,tcaptype,flowtype>::what_segment(node_id i, termtype def) const
     return (nodes[i].parent? nodes[i].term: def);
 }
 
+/// After the maxflow is computed, append to 'list' the nodes of segment 't'
+/// in increasing order, in a single sequential pass over the nodes. The
+/// default segment 'def' is as in what_segment.
+template <typename captype, typename tcaptype, typename flowtype>
+void Graph<captype,tcaptype,flowtype>::segment_nodes(termtype t,
+                                                     std::vector<node_id>& list,
+                                                     termtype def) const
+{
+    const node_id n = static_cast<node_id>(nodes.size());
+    for(node_id i=0; i<n; i++)
+        if((nodes[i].parent? nodes[i].term: def) == t)
+            list.push_back(i);
+}
+
 #endif
@@ -62,6 +62,11 @@ public:
 
     flowtype maxflow();
     termtype what_segment(node_id i, termtype defaultSegm=SOURCE) const;
+    void segment_nodes(termtype t, std::vector<node_id>& list,
+                       termtype defaultSegm=SOURCE) const;
+    void set_abort(bool (*f)(void*), void* data);
+    bool aborted() const { return bAborted; }
+    static size_t memory(int nbNodes, int nbArcs);
 
 private:
     struct node;
@@ -92,6 +97,9 @@ private:
     node *activeBegin, *activeEnd; ///< list of active nodes
     std::queue<node*> orphans; ///< list of pointers to orphans
     int time; ///< monotonically increasing global counter
+    bool (*abortFunc)(void*); ///< maxflow stops when it returns true
+    void* abortData; ///< argument of abortFunc
+    bool bAborted; ///< maxflow was stopped by abortFunc
 
     // special constants for node.parent
     arc* TERMINAL; ///< arc to terminal
@@ -263,12 +263,26 @@ void Graph<captype,tcaptype,flowtype>::adopt_orphans()
     }
 }
 
+/// Set function called regularly by maxflow with argument data. If it
+/// returns true, maxflow stops: the flow is not maximal and the cut is
+/// meaningless (see aborted).
+template <typename captype, typename tcaptype, typename flowtype>
+void Graph<captype,tcaptype,flowtype>::set_abort(bool (*f)(void*), void* data)
+{
+    abortFunc = f;
+    abortData = data;
+}
+
 /// Compute the maxflow.
 template <typename captype, typename tcaptype, typename flowtype>
 flowtype Graph<captype,tcaptype,flowtype>::maxflow()
 {
     maxflow_init();
     for(node *i=0; i || (i=next_active());) {
+        if(abortFunc && (time&0xff)==0 && abortFunc(abortData)) {
+            bAborted = true;
+            break;
+        }
         arc* a = grow_tree(i);
         ++time;
         if(!a) {
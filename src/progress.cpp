@@ -0,0 +1,61 @@
+/**
+ * @file progress.cpp
+ * @brief Reporting of progress of disparity estimation
+ * @author Pascal Monasse <monasse@imagine.enpc.fr>
+ *
+ * Copyright (c) 2017, Pascal Monasse
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * You should have received a copy of the GNU General Pulic License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "progress.h"
+#include "timer.h"
+#include <cstdlib>
+#include <iostream>
+#include <iomanip>
+#include <sstream>
+
+const double ConsoleProgress::FLUSH_PERIOD = 0.5;
+
+/// Constructor
+ConsoleProgress::ConsoleProgress()
+: lastFlush(wall_time()) {}
+
+/// Display line of text.
+void ConsoleProgress::info(const std::string& text) {
+    std::cout << text << std::endl;
+    lastFlush = wall_time();
+}
+
+/// Display character of move, flushed only if the last flush is old enough.
+void ConsoleProgress::move(int, int, char result, int, double) {
+    std::cout << result;
+    const double t = wall_time();
+    if(t-lastFlush >= FLUSH_PERIOD) {
+        std::cout << std::flush;
+        lastFlush = t;
+    }
+}
+
+/// Display energy, its decrease (also relative if oldE!=0), elapsed time and
+/// number of skipped moves.
+void ConsoleProgress::iteration(int, int E, int oldE, int skipped,
+                                double elapsed) {
+    std::ostringstream s;
+    s << " E=" << E << " dE=" << oldE-E;
+    if(oldE!=0)
+        s << " (" << std::fixed << std::setprecision(4)
+          << 100.0f*(oldE-E)/std::abs(oldE) << "%)";
+    s << " t=" << (int)(1000*elapsed) << "ms";
+    if(skipped>=0)
+        s << " skipped=" << skipped;
+    std::cout << s.str() << std::endl;
+    lastFlush = wall_time();
+}
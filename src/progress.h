@@ -0,0 +1,59 @@
+/**
+ * @file progress.h
+ * @brief Reporting of progress of disparity estimation
+ * @author Pascal Monasse <monasse@imagine.enpc.fr>
+ *
+ * Copyright (c) 2017, Pascal Monasse
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * You should have received a copy of the GNU General Pulic License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef PROGRESS_H
+#define PROGRESS_H
+
+#include <string>
+
+/// Receiver of the progress of Match::KZ2 (see Match::SetProgress). This base
+/// class ignores everything, derived classes override what they report.
+/// Methods are never called concurrently.
+class Progress {
+public:
+    virtual ~Progress() {}
+    /// Line of information on the algorithm.
+    virtual void info(const std::string& /*text*/) {}
+    /// Move number \a index (from 0) of the iteration, of label \a alpha
+    /// (first label for a range move). Result is '*' for an accepted move,
+    /// '-' for a rejected one and '.' for a move skipped as useless. Energy
+    /// \a E is after the move, at \a elapsed seconds from start of the run.
+    virtual void move(int /*index*/, int /*alpha*/, char /*result*/,
+                      int /*E*/, double /*elapsed*/) {}
+    /// End of iteration \a iter (from 0), reaching energy \a E from \a oldE.
+    /// Number of moves skipped is \a skipped (<0 if not applicable).
+    virtual void iteration(int /*iter*/, int /*E*/, int /*oldE*/,
+                           int /*skipped*/, double /*elapsed*/) {}
+};
+
+/// Display of progress on standard output: one character per move, one line
+/// per iteration. Characters of moves are flushed at most every
+/// FLUSH_PERIOD seconds rather than after each move.
+class ConsoleProgress : public Progress {
+public:
+    ConsoleProgress();
+    virtual void info(const std::string& text);
+    virtual void move(int index, int alpha, char result, int E,
+                      double elapsed);
+    virtual void iteration(int iter, int E, int oldE, int skipped,
+                           double elapsed);
+    static const double FLUSH_PERIOD;
+private:
+    double lastFlush; ///< Time of last flush of standard output
+};
+
+#endif
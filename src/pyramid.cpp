@@ -0,0 +1,136 @@
+/**
+ * @file pyramid.cpp
+ * @brief Coarse-to-fine initialization of disparity map
+ * @author Pascal Monasse <monasse@imagine.enpc.fr>
+ *
+ * Copyright (c) 2017, Pascal Monasse
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * You should have received a copy of the GNU General Pulic License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+The images are downsampled by 2 and the disparity map is estimated at this
+coarse scale, recursively. The coarse map, upsampled, initializes the map at
+the fine scale, whose disparity at each pixel is then searched only in a
+small window around the coarse estimate.
+*/
+
+#include "match.h"
+#include "progress.h"
+#include "timer.h"
+#include <algorithm>
+#include <iostream>
+#include <sstream>
+
+/// Margin added to the window of disparities allowed at each pixel.
+static const int PYRAMID_MARGIN=2;
+
+/// Downsample by 2 the image, with c bytes per pixel, averaging 2x2 blocks.
+static GeneralImage half_size(GeneralImage im, int c) {
+    const int w=imGetXSize(im), h=imGetYSize(im);
+    const int w2=(w+1)/2, h2=(h+1)/2;
+    GeneralImage out = (GeneralImage)imNew(c==1? IMAGE_GRAY: IMAGE_RGB, w2,h2);
+    if(! out)
+        { std::cerr << "Not enough memory!" << std::endl; exit(1); }
+    for(int y=0; y<h2; y++) {
+        const int y1=std::min(2*y+1,h-1);
+        const unsigned char* in0 = (const unsigned char*)(im+2*y)->data;
+        const unsigned char* in1 = (const unsigned char*)(im+y1)->data;
+        unsigned char* o = (unsigned char*)(out+y)->data;
+        for(int x=0; x<w2; x++) {
+            const int x0=2*x*c, x1=std::min(2*x+1,w-1)*c;
+            for(int i=0; i<c; i++)
+                o[x*c+i] = (unsigned char)
+                    ((in0[x0+i]+in0[x1+i]+in1[x0+i]+in1[x1+i]+2)/4);
+        }
+    }
+    return out;
+}
+
+/// Largest integer not larger than a/2.
+inline int floor_half(int a) { return (a>=0)? a/2: -((1-a)/2); }
+
+/// Estimate disparity map at coarser level of pyramid, use it to initialize
+/// the disparity map and restrict disparities.
+///
+/// The disparity of pixel p is initialized to twice the one of p/2 at the
+/// coarse level. It is allowed in the range of twice the coarse disparities
+/// of the 3x3 neighborhood of p/2, extended by PYRAMID_MARGIN. If they are
+/// all occluded, all disparities are allowed. Fixed rows are unchanged.
+void Match::InitFromCoarse() {
+    const bool color = (imLeft==0);
+    const int c = color? 3: 1;
+    GeneralImage L = color? (GeneralImage)imColorLeft: (GeneralImage)imLeft;
+    GeneralImage R = color? (GeneralImage)imColorRight: (GeneralImage)imRight;
+    GeneralImage L2 = half_size(L,c), R2 = half_size(R,c);
+
+    Match coarse(L2, R2, color);
+    coarse.SetCacheDir(cacheDir);
+    coarse.SetDispRange(floor_half(dispMin), -floor_half(-dispMax));
+    Parameters coarseParams = params;
+    --coarseParams.pyramidLevels;
+    coarse.SetParameters(&coarseParams);
+    coarse.progress = progress;
+    coarse.deadline = deadline;
+    // Other sequence than this band's, or rand() if 0 (see SolveTile)
+    coarse.randomState = randomState*0x9E3779B97F4A7C15ULL;
+    if(progress) {
+        std::ostringstream s;
+        s << "Pyramid level " << coarse.imSizeL.x << 'x' << coarse.imSizeL.y;
+        progress->info(s.str());
+    }
+    const double t0 = wall_time();
+    coarse.KZ2();
+    if(progress) {
+        std::ostringstream s;
+        s << "Level done t=" << (int)(1000*(wall_time()-t0)) << "ms";
+        progress->info(s.str());
+    }
+
+    if(! dispLo) {
+        dispLo = (IntImage)imNew(IMAGE_INT, imSizeL);
+        dispHi = (IntImage)imNew(IMAGE_INT, imSizeL);
+        if(!dispLo || !dispHi)
+            { std::cerr << "Not enough memory!" << std::endl; exit(1); }
+    }
+    const Coord size2 = coarse.imSizeL;
+    RectIterator end=rectEnd(imSizeL);
+    for(RectIterator p=rectBegin(imSizeL); p!=end; ++p) {
+        if((*p).y<fixedTop || (*p).y>=imSizeL.y-fixedBottom)
+            continue; // Fixed row, see allowed
+        Coord q((*p).x/2, (*p).y/2);
+        int lo=dispMax+1, hi=dispMin-1;
+        for(int dy=-1; dy<=1; dy++)
+            for(int dx=-1; dx<=1; dx++) {
+                Coord n(q.x+dx, q.y+dy);
+                if(! inRect(n,size2)) continue;
+                int d = IMREF(coarse.d_left,n);
+                if(d==OCCLUDED) continue;
+                lo = std::min(lo, 2*d);
+                hi = std::max(hi, 2*d);
+            }
+        if(lo>hi) // All occluded
+            lo = dispMin, hi = dispMax;
+        IMREF(dispLo,*p) = std::max(dispMin, lo-PYRAMID_MARGIN);
+        IMREF(dispHi,*p) = std::min(dispMax, hi+PYRAMID_MARGIN);
+
+        // Distinct pixels in a row have distinct matches: uniqueness holds
+        int d = inRect(q,size2)? IMREF(coarse.d_left,q): OCCLUDED;
+        if(d!=OCCLUDED) {
+            d *= 2;
+            if(d<dispMin || d>dispMax || !inRect(*p+d,imSizeR))
+                d = OCCLUDED;
+        }
+        IMREF(d_left,*p) = d;
+    }
+
+    imFree(L2);
+    imFree(R2);
+}
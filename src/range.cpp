@@ -0,0 +1,176 @@
+/**
+ * @file range.cpp
+ * @brief Moves offering a range of disparities in a single graph cut
+ * @author Pascal Monasse <monasse@imagine.enpc.fr>
+ *
+ * Copyright (c) 2017, Pascal Monasse
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * You should have received a copy of the GNU General Pulic License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+A range move lets each pixel take a disparity in a window [a,a+r) in a single
+graph cut. An exact multi-label move (as for truncated convex priors) is not
+possible here: two assignments of a pixel at different disparities of the
+window must not be both active, a non-submodular constraint. Instead, each
+row is proposed the disparities of the window (or occlusion) minimizing its
+energy without the vertical smoothness terms, by dynamic programming.
+Conflicting proposals for a same pixel of the right image are resolved in
+favor of the lowest data term, the other pixels being proposed occlusion.
+The proposal is then fused with the current map (see FusionMove), which
+enforces occlusion and uniqueness with the current map.
+*/
+
+#include "match.h"
+#include "progress.h"
+#include "timer.h"
+#include <algorithm>
+#include <iostream>
+#include <iomanip>
+#include <sstream>
+#include <vector>
+#include <cstdlib>
+
+/// Proposal of disparities in [a,a+r) for a range move, satisfying the
+/// uniqueness constraint. Fixed rows keep their current disparities.
+///
+/// In each row, the proposal minimizes by dynamic programming the energy of
+/// the row (data and horizontal smoothness terms) over disparities of the
+/// range and occlusion. The smoothness penalty between neighbors at different
+/// disparities is a sum of a term for each, so that the minimum over the
+/// disparity of the previous pixel is reached at the best or second best one.
+void Match::range_proposal(int a, int r, ShortImage proposal) const {
+    const int w=imSizeL.x, h=imSizeL.y;
+    const int n=r+1; // Labels a,...,a+r-1 and occlusion (label r)
+    const int INF=1<<29;
+    std::vector<int> cost(n), prev(n), back(w*n); // back<0: same label
+    std::vector<int> data(w); // Data term of proposal
+    std::vector<int> claim(imSizeR.x); // Left pixel proposed to match
+    for(Coord p(0,0); p.y<h; p.y++) {
+        if(p.y<fixedTop || p.y>=h-fixedBottom) {
+            std::copy(&IMREF(d_left,p), &IMREF(d_left,p)+w,
+                      &IMREF(proposal,p));
+            continue;
+        }
+        for(p.x=0; p.x<w; p.x++) {
+            const Coord p2(p.x-1,p.y); // Left neighbor, see NEIGHBORS
+            int best1=-1, best2=-1; // Two best labels at previous pixel
+            for(int i=0; p.x>0 && i<n; i++) {
+                prev[i] = cost[i];
+                if(i<r && inRect(p+(a+i),imSizeR) && inRect(p2+(a+i),imSizeR))
+                    prev[i] += smoothness_penalty(p,p2,a+i);
+                if(best1<0 || prev[i]<prev[best1])
+                    best2=best1, best1=i;
+                else if(best2<0 || prev[i]<prev[best2])
+                    best2=i;
+            }
+            for(int i=0; i<n; i++) {
+                const int d=a+i;
+                int u = 0; // Data term
+                if(i<r)
+                    u = (d>=dispMin && d<=dispMax && allowed(p,d) &&
+                         inRect(p+d,imSizeR))?
+                        data_occlusion_penalty(p,p+d): INF;
+                back[p.x*n+i] = -1;
+                if(p.x>0) {
+                    int j = (best1!=i)? best1: best2;
+                    int c = prev[j];
+                    if(i<r && inRect(p+d,imSizeR) && inRect(p2+d,imSizeR))
+                        c += smoothness_penalty(p,p2,d); // Otherwise INF
+                    if(c<cost[i])
+                        back[p.x*n+i] = j;
+                    u += std::min(c,cost[i]);
+                }
+                cost[i] = std::min(u,INF);
+            }
+        }
+        int i = (int)(std::min_element(cost.begin(),cost.end())-cost.begin());
+        for(p.x=w-1; p.x>=0; p.x--) {
+            int d = (i<r)? a+i: OCCLUDED;
+            IMREF(proposal,p) = d;
+            data[p.x] = (d!=OCCLUDED)? data_occlusion_penalty(p,p+d): 0;
+            if(back[p.x*n+i]>=0)
+                i = back[p.x*n+i];
+        }
+
+        std::fill(claim.begin(), claim.end(), -1);
+        for(p.x=0; p.x<w; p.x++) {
+            int d = IMREF(proposal,p);
+            if(d==OCCLUDED) continue;
+            int& x = claim[p.x+d];
+            if(x>=0 && data[x]<=data[p.x])
+                IMREF(proposal,p) = OCCLUDED;
+            else {
+                if(x>=0)
+                    IMREF(proposal,Coord(x,p.y)) = OCCLUDED;
+                x = p.x;
+            }
+        }
+    }
+}
+
+/// Main algorithm with range moves of width params.rangeWidth instead of
+/// alpha-expansions. The ranges tile the disparity interval, shifted by half
+/// their width at odd iterations, and are taken in random order. The
+/// iterations stop when no range move decreases the energy, when the
+/// decrease is below params.tolerance or at the deadline.
+void Match::RunRanges() {
+    const double t0 = wall_time();
+    const int r = params.rangeWidth;
+    const int nRanges = (dispMax-dispMin+1+r/2)/r + 1;
+    std::vector<int> order(nRanges);
+    ShortImage proposal = (ShortImage)imNew(IMAGE_SHORT, imSizeL);
+    if(! proposal)
+        { std::cerr << "Not enough memory!" << std::endl; exit(1); }
+
+    E = ComputeEnergy();
+    if(progress) {
+        std::ostringstream s;
+        s << "E=" << E;
+        progress->info(s.str());
+    }
+
+    int step=0, nRangesIter=0;
+    bool moved=true;
+    bool stop=false; // Energy decrease below tolerance
+    for(int iter=0; iter<params.maxIter && moved && !stop && !past_deadline();
+        iter++) {
+        const int oldE = E;
+        const int a0 = dispMin - ((iter%2==1)? r/2: 0);
+        order.clear();
+        for(int i=0; i<nRanges; i++) // Ranges intersecting [dispMin,dispMax]
+            if(a0+(i+1)*r>dispMin && a0+i*r<=dispMax)
+                order.push_back(i);
+        if(! order.empty())
+            shuffle(&order[0], (int)order.size());
+        moved = false;
+        for(size_t i=0; i<order.size() && !past_deadline(); i++) {
+            ++step;
+            const int a = a0+order[i]*r;
+            range_proposal(a, r, proposal);
+            bool accept = (FusionMove(proposal)==ACCEPTED);
+            moved = moved || accept;
+            if(progress)
+                progress->move((int)i, a, accept? '*': '-', E, wall_time()-t0);
+        }
+        nRangesIter = (int)order.size();
+        if(progress)
+            progress->iteration(iter, E, oldE, -1, wall_time()-t0);
+        stop = converged(oldE);
+    }
+
+    if(progress) { // 1 number after decimal separator
+        std::ostringstream s;
+        s << std::fixed << std::setprecision(1)
+          << (float)step/nRangesIter << " iterations";
+        progress->info(s.str());
+    }
+    imFree(proposal);
+}
@@ -0,0 +1,164 @@
+/**
+ * @file sgm.cpp
+ * @brief Initialization of disparity map by semi-global matching
+ * @author Pascal Monasse <monasse@imagine.enpc.fr>
+ *
+ * Copyright (c) 2017, Pascal Monasse
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * You should have received a copy of the GNU General Pulic License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+Semi-global matching (H. Hirschmuller, "Stereo processing by semiglobal
+matching and mutual information", IEEE PAMI 30(2):328-341, 2008) with the
+energy terms of KZ2, aggregated along 4 paths (horizontal and vertical, both
+ways). As in KZ2, occlusion is a label of cost K, a change of disparity
+between neighbors costs twice the smoothness penalty and a change to or from
+occlusion costs it once. Since the matching costs of a pixel are independent
+of the other pixels of its path, the paths of a same direction are computed
+in parallel, and the loops over disparities are plain enough to be
+vectorized by the compiler.
+*/
+
+#include "match.h"
+#include <algorithm>
+#include <iostream>
+#include <new>
+#include <vector>
+
+/// Multiplier of smoothness penalties along paths. A path ignores the
+/// smoothness terms across it, and stronger penalties yield fewer conflicts
+/// of uniqueness between the winning disparities.
+static const int SGM_SMOOTHNESS=4;
+
+/// Cost of a path reaching a pixel with costs C, from the costs Lp of the
+/// path at the previous pixel, for the n disparities followed by occlusion:
+/// L(d) = C(d) + min(Lp(d), min Lp+P) - min Lp, the penalty being P/2
+/// between occlusion and any disparity.
+static void sgm_step(const int* C, const int* Lp, int* L, int n, int P) {
+    const int mD = *std::min_element(Lp, Lp+n);
+    const int m = std::min(mD, Lp[n]);
+    const int v0 = std::min(mD+P, Lp[n]+P/2) - m;
+    for(int d=0; d<n; d++)
+        L[d] = C[d] + std::min(Lp[d]-m, v0);
+    L[n] = C[n] + std::min(Lp[n], mD+P/2) - m;
+}
+
+/// Is there an intensity edge between neighbors p1 and p2 of the left image?
+bool Match::left_edge(Coord p1, Coord p2) const {
+    int d, dMax=0;
+    if(imLeft)
+        dMax = IMREF(imLeft,p1) - IMREF(imLeft,p2);
+    else
+        for(int i=0; i<3; i++) {
+            d = IMREF(imColorLeft,p1).c[i] - IMREF(imColorLeft,p2).c[i];
+            if(d<0) d = -d;
+            if(dMax<d) dMax = d;
+        }
+    if(dMax<0) dMax = -dMax;
+    return (dMax>=params.edgeThresh);
+}
+
+/// Add to \a sum the costs of the path starting at p and following \a step
+/// until leaving the image. The data costs are in \a cost, with value
+/// 0xffff for matches outside the right image, or computed by data_penalty
+/// if cost is NULL. The sums have one more element per pixel, for occlusion.
+void Match::sgm_path(Coord p, Coord step, const unsigned short* cost,
+                     unsigned short* sum) const {
+    const int n=dispMax-dispMin+1;
+    const int maxC = params.K+2*params.lambda1; // Worse than occlusion
+    std::vector<int> C(n+1), buf1(n+1), buf2(n+1);
+    int *Lp=&buf1[0], *L=&buf2[0];
+    C[n] = params.K;
+    for(bool first=true; inRect(p,imSizeL); p=p+step, first=false) {
+        const size_t i = (size_t)p.y*imSizeL.x+p.x;
+        for(int d=0; d<n; d++) { // Truncated, so that sums fit in 16 bits
+            int c = cost? cost[i*n+d]: 0xffff;
+            if(!cost && inRect(p+(dispMin+d),imSizeR))
+                c = data_penalty(p, p+(dispMin+d));
+            C[d] = (c==0xffff)? maxC: std::min(params.denominator*c,maxC);
+        }
+        if(first)
+            std::copy(C.begin(), C.end(), L);
+        else {
+            const Coord q(p.x-step.x, p.y-step.y); // Previous pixel
+            int P = left_edge(p,q)? params.lambda2: params.lambda1;
+            sgm_step(&C[0], Lp, L, n, 2*SGM_SMOOTHNESS*P);
+        }
+        unsigned short* S = &sum[i*(n+1)];
+        for(int d=0; d<=n; d++)
+            S[d] = (unsigned short)std::min(S[d]+L[d], 0xffff);
+        std::swap(Lp, L);
+    }
+}
+
+/// Initialize the disparity map by semi-global matching. The disparity of a
+/// pixel is occluded if its data term is larger than the occlusion cost K,
+/// and the uniqueness constraint is enforced (see enforce_uniqueness).
+/// Fixed rows are unchanged.
+///
+/// The sums of paths take 2 bytes per pixel and disparity: if memory is
+/// lacking, the map is left unchanged. The data costs are read in the cost
+/// volume if any, otherwise they are computed once in a buffer of the same
+/// size, or on each path if memory is lacking.
+void Match::InitSGM() {
+    const int w=imSizeL.x, h=imSizeL.y, n=dispMax-dispMin+1;
+    unsigned short* sum = new (std::nothrow) unsigned short[(size_t)w*h*(n+1)];
+    if(! sum) {
+        std::cerr << "Not enough memory for SGM, skipped" << std::endl;
+        return;
+    }
+    std::fill_n(sum, (size_t)w*h*(n+1), 0);
+    unsigned short* cost = 0;
+    if(! costVolume)
+        cost = new (std::nothrow) unsigned short[(size_t)w*h*n];
+    if(cost) {
+#ifdef _OPENMP
+#pragma omp parallel for
+#endif
+        for(int y=0; y<h; y++)
+            for(Coord p(0,y); p.x<w; p.x++) {
+                unsigned short* c = &cost[((size_t)y*w+p.x)*n];
+                for(int d=dispMin; d<=dispMax; d++)
+                    c[d-dispMin] = (unsigned short)
+                        (inRect(p+d,imSizeR)? data_penalty(p,p+d): 0xffff);
+            }
+    }
+
+#ifdef _OPENMP
+#pragma omp parallel for
+#endif
+    for(int y=0; y<h; y++) {
+        sgm_path(Coord(0,y),   Coord(+1,0), cost, sum);
+        sgm_path(Coord(w-1,y), Coord(-1,0), cost, sum);
+    }
+#ifdef _OPENMP
+#pragma omp parallel for
+#endif
+    for(int x=0; x<w; x++) {
+        sgm_path(Coord(x,0),   Coord(0,+1), cost, sum);
+        sgm_path(Coord(x,h-1), Coord(0,-1), cost, sum);
+    }
+
+#ifdef _OPENMP
+#pragma omp parallel for
+#endif
+    for(int y=fixedTop; y<h-fixedBottom; y++)
+        for(Coord p(0,y); p.x<w; p.x++) {
+            const size_t i = (size_t)y*w+p.x;
+            const unsigned short* S = &sum[i*(n+1)];
+            const int d = (int)(std::min_element(S, S+n+1)-S);
+            IMREF(d_left,p) = (d<n && inRect(p+(dispMin+d),imSizeR))?
+                dispMin+d: OCCLUDED;
+        }
+    delete [] cost;
+    delete [] sum;
+    enforce_uniqueness();
+}
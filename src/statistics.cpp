@@ -18,44 +18,194 @@
 
 #include <algorithm>
 #include <iostream>
+#include <iomanip>
+#include <vector>
+#include <cmath>
+#include <sstream>
 #include "match.h"
+#include "progress.h"
+
+/// Seed of the random generator used in sampled estimation of K.
+static const unsigned int K_SAMPLING_SEED=2017;
+
+/// Hash function of integers (Thomas Wang), used as random generator
+/// independent of the order of calls, thus of threads.
+static unsigned int hash(unsigned int a) {
+    a = (a ^ 61) ^ (a >> 16);
+    a = a + (a << 3);
+    a = a ^ (a >> 4);
+    a = a * 0x27d4eb2d;
+    a = a ^ (a >> 15);
+    return a;
+}
+
+/// The k'th smallest value among data_penalty(p,p+d) for all d.
+/// buf must be an array of size the number of disparities.
+int Match::kth_data_penalty(Coord p, int k, int* buf) const {
+    const int dispSize = dispMax-dispMin+1;
+    for(int i=0; i<dispSize; i++)
+        buf[i] = data_penalty(p, p+dispMin+i);
+    std::nth_element(buf, buf+k-1, buf+dispSize);
+    return buf[k-1];
+}
 
 /// Heuristic for selecting parameter 'K'
 /// Details are described in Kolmogorov's thesis
-float Match::GetK()
+///
+/// K is the average over pixels of the k'th smallest data penalty among all
+/// disparities, with k around 0.25 times the number of disparities.
+/// Rows are distributed over threads, each one selecting the k'th smallest
+/// value of its pixels with std::nth_element. Sums are kept per row and
+/// added in row order, so that the result does not depend on threads.
+///
+/// If samples>0, K is only estimated from a subset of pixels: a fraction of
+/// the pixels if samples<=1, otherwise their number. Pixels in raster order are
+/// split in as many strata of equal size, one pixel being drawn at random in
+/// each stratum. The confidence interval of the estimate is displayed.
+float Match::GetK(float samples)
 {
-    int i = dispMax-dispMin+1;
-    int k = (i+2)/4; // around 0.25 times the number of disparities
+    const int dispSize = dispMax-dispMin+1;
+    int k = (dispSize+2)/4; // around 0.25 times the number of disparities
     if(k<3) k=3;
+    if(k>dispSize) k=dispSize; // Then the max over all disparities
+
+    const int xmin = std::max(0,-dispMin); // 0<=x,x+dispMin
+    const int xmax = std::min(imSizeL.x,imSizeR.x-dispMax); // x<wl,x+dispMax<wr
+    const int ymax = std::min(imSizeL.y,imSizeR.y);
+    if(xmin>=xmax || ymax<=0)
+        { std::cerr<<"GetK: Not enough samples!"<<std::endl; exit(1); }
+    const int w = xmax-xmin;
+    const double N = (double)w*ymax; // Number of pixels
 
-    int* array = new int[k];
-    std::fill_n(array, k, 0);
-    int sum=0, num=0;
-
-    int xmin = std::max(0,-dispMin); // 0<=x,x+dispMin
-    int xmax = std::min(imSizeL.x,imSizeR.x-dispMax); // x<wl,x+dispMax<wr
-    Coord p;
-    for(p.y=0; p.y<imSizeL.y && p.y<imSizeR.y; p.y++)
-    for(p.x=xmin; p.x<xmax; p.x++) {
-        // compute k'th smallest value among data_penalty(p, p+d) for all d
-        for(int i=0, d=dispMin; d<=dispMax; d++) {
-            int delta = (imLeft?
-                         data_penalty_gray (p,p+d):
-                         data_penalty_color(p,p+d));
-            if(i<k) array[i++] = delta;
-            else for(i=0; i<k; i++)
-                     if(delta<array[i])
-                         std::swap(delta, array[i]);
+    int n = (int)(samples<=1? samples*N+.5: samples);
+    if(samples>0 && n<N)
+        return GetKSampled(k, std::max(n,2));
+
+    std::vector<int> rowSum(ymax, 0);
+#ifdef _OPENMP
+#pragma omp parallel
+#endif
+    {
+        std::vector<int> costs(w*dispSize); // Costs of pixel x at x*dispSize
+#ifdef _OPENMP
+#pragma omp for schedule(static)
+#endif
+        for(int y=0; y<ymax; y++) {
+            Coord p(0,y);
+            for(int i=0; i<dispSize; i++) // Disparity in outer loop, to read
+                for(p.x=xmin; p.x<xmax; p.x++) // cost volume row by row
+                    costs[(p.x-xmin)*dispSize+i] = data_penalty(p,p+dispMin+i);
+            int sum=0;
+            for(std::vector<int>::iterator it=costs.begin(); it!=costs.end();
+                it+=dispSize) {
+                std::nth_element(it, it+k-1, it+dispSize);
+                sum += it[k-1];
+            }
+            rowSum[y] = sum;
         }
-        sum += *std::max_element(array, array+k);
-        num ++;
     }
 
-    delete [] array;
-    if(num==0) { std::cerr<<"GetK: Not enough samples!"<<std::endl; exit(1); }
+    double sum=0;
+    for(int y=0; y<ymax; y++)
+        sum += rowSum[y];
     if(sum==0) { std::cerr<<"GetK failed: K is 0!"<<std::endl; exit(1); }
 
-    float K = ((float)sum)/num;
-    std::cout <<"Computing statistics: K(data_penalty noise) ="<< K <<std::endl;
+    float K = (float)(sum/N);
+    if(progress) {
+        std::ostringstream s;
+        s << "Computing statistics: K(data_penalty noise) =" << K;
+        progress->info(s.str());
+    }
     return K;
 }
+
+/// Estimate K from n pixels drawn by stratified sampling, see GetK.
+///
+/// The variance of the mean is estimated by collapsing pairs of consecutive
+/// strata: V = (1-n/N)/n^2 * sum over pairs of (y1-y2)^2. This overestimates
+/// the variance when neighbor strata are similar, so the interval is rather
+/// conservative.
+float Match::GetKSampled(int k, int n)
+{
+    const int dispSize = dispMax-dispMin+1;
+    const int xmin = std::max(0,-dispMin);
+    const int xmax = std::min(imSizeL.x,imSizeR.x-dispMax);
+    const int w = xmax-xmin;
+    const double N = (double)w*std::min(imSizeL.y,imSizeR.y);
+
+    std::vector<int> values(n);
+#ifdef _OPENMP
+#pragma omp parallel
+#endif
+    {
+        std::vector<int> costs(dispSize);
+#ifdef _OPENMP
+#pragma omp for schedule(static)
+#endif
+        for(int i=0; i<n; i++) {
+            double begin=std::floor(N*i/n), end=std::floor(N*(i+1)/n);
+            double r = hash(K_SAMPLING_SEED+hash(i)) / 4294967296.0; // [0,1)
+            double j = begin + std::floor(r*(end-begin)); // In stratum
+            int y = (int)(j/w), x = xmin + (int)(j-(double)y*w);
+            values[i] = kth_data_penalty(Coord(x,y), k, &costs[0]);
+        }
+    }
+
+    double sum=0, var=0;
+    for(int i=0; i<n; i++)
+        sum += values[i];
+    for(int i=0; i+1<n; i+=2)
+        var += (values[i]-values[i+1])*(double)(values[i]-values[i+1]);
+    if(sum==0) { std::cerr<<"GetK failed: K is 0!"<<std::endl; exit(1); }
+
+    double mean = sum/n;
+    var *= (1-n/N)/((double)n*n);
+    double radius = 1.96*std::sqrt(var); // 95% confidence
+    float K = (float)mean;
+    if(progress) {
+        std::ostringstream s;
+        s << "Computing statistics: K(data_penalty noise) =" << K
+          << " estimated from " << n << " pixels ("
+          << std::setprecision(3) << 100*n/N << "%), "
+          << "95% confidence interval [" << std::setprecision(6)
+          << mean-radius << ',' << mean+radius << ']';
+        progress->info(s.str());
+    }
+    return K;
+}
+
+/// Estimate for each disparity the energy decrease of its expansion.
+///
+/// Each pixel votes for the disparity of lowest data+occlusion penalty, if it
+/// is better than occlusion, with weight the opposite of this penalty. This is
+/// the gain of the first expansions from a fully occluded map, neglecting
+/// smoothness. The array \a gain has the size of the disparity range.
+void Match::wta_gains(float* gain) const {
+    const int dispSize = dispMax-dispMin+1;
+    std::vector<int> best(imSizeL.x*imSizeL.y); // Disparity index of winner
+    std::vector<int> penalty(imSizeL.x*imSizeL.y); // Penalty of winner
+#ifdef _OPENMP
+#pragma omp parallel for schedule(static)
+#endif
+    for(int y=0; y<imSizeL.y; y++)
+        for(int x=0; x<imSizeL.x; x++) {
+            Coord p(x,y);
+            int iBest=-1, minPenalty=0; // Occlusion
+            for(int i=0; i<dispSize; i++) {
+                Coord q = p+(dispMin+i);
+                if(! inRect(q,imSizeR)) continue;
+                int pen = data_occlusion_penalty(p,q);
+                if(pen<minPenalty) {
+                    minPenalty = pen;
+                    iBest = i;
+                }
+            }
+            best[y*imSizeL.x+x] = iBest;
+            penalty[y*imSizeL.x+x] = minPenalty;
+        }
+
+    std::fill_n(gain, dispSize, 0.0f);
+    for(size_t i=0; i<best.size(); i++)
+        if(best[i]>=0)
+            gain[best[i]] -= (float)penalty[i];
+}
@@ -0,0 +1,200 @@
+/**
+ * @file tile.cpp
+ * @brief Processing by bands of rows, for memory-bounded computation
+ * @author Pascal Monasse <monasse@imagine.enpc.fr>
+ *
+ * Copyright (c) 2017, Pascal Monasse
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * You should have received a copy of the GNU General Pulic License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+With a memory budget, the left image is processed by horizontal bands of full
+rows. Since matches are in the same row, a band needs only the same rows of
+the right image and the uniqueness constraint never involves two bands: they
+interact only through the smoothness term between their boundary rows.
+Bands of even index are solved first, independently, with a margin of rows
+above and below that is discarded. Bands of odd index are then solved with
+the rows just above and below fixed to the disparities of the adjacent even
+bands. Bands of a same parity are solved concurrently.
+*/
+
+#include "match.h"
+#include "energy.h"
+#include "progress.h"
+#include "timer.h"
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <sstream>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+/// Number of rows above and below a band solved without fixed borders.
+static const int TILE_MARGIN=16;
+
+/// Estimate of the memory in bytes per pixel of a band: images with c bytes
+/// per pixel, data term, disparity map, variables, region, graph of
+/// expansion move, with the pixels of its variables, and buffers of SGM.
+static size_t band_bytes_per_pixel(const Match::Parameters& params, int c,
+                                   int dispSize) {
+    size_t n = 2*c; // Left and right images
+    n += (params.dataCost==Match::Parameters::CENSUS)? 2*sizeof(int): 4*c;
+    if(params.bCostVolume)
+        n += dispSize*sizeof(short);
+    n += sizeof(short)+2*sizeof(int)+1; // d_left, vars, region
+    if(params.pyramidLevels>1)
+        n += 2*sizeof(int); // dispLo, dispHi
+    n += Energy::memory(2,12) + 2*sizeof(int); // See ExpansionMove
+    if(params.bSGM) // Sums of paths and data costs, see InitSGM
+        n += (dispSize+1 + (params.bCostVolume? 0: dispSize))*sizeof(short);
+    if(params.pyramidLevels>1) // Coarser levels: less than 1/4+1/16+...
+        n += n/3;
+    return n;
+}
+
+/// Memory in bytes per pixel of the full image, outside the budget of bands:
+/// images with c bytes per pixel, data term, disparity map and variables.
+static size_t image_bytes_per_pixel(const Match::Parameters& params, int c) {
+    size_t n = 2*c; // Left and right images
+    n += (params.dataCost==Match::Parameters::CENSUS)? 2*sizeof(int): 4*c;
+    n += sizeof(short)+2*sizeof(int); // d_left, vars
+    return n;
+}
+
+/// Copy of rows [y0,y1) of image with c bytes per pixel.
+static GeneralImage crop_rows(GeneralImage im, int y0, int y1, int c) {
+    const int w=imGetXSize(im);
+    GeneralImage out = (GeneralImage)imNew(c==1? IMAGE_GRAY: IMAGE_RGB,
+                                           w, y1-y0);
+    if(! out)
+        { std::cerr << "Not enough memory!" << std::endl; exit(1); }
+    for(int y=y0; y<y1; y++)
+        std::memcpy((out+(y-y0))->data, (im+y)->data, w*c);
+    return out;
+}
+
+/// Compute disparities of rows [y0,y1) as part of a band of rows.
+///
+/// If fixBorders, the band has CENSUS_RADIUS more rows above and below, so
+/// that the data term of its rows is the same as in the full image. Their
+/// disparity is fixed to its current value, only the adjacent rows
+/// interacting with the band. Otherwise, it has TILE_MARGIN more rows above
+/// and below, whose computed disparity is discarded. The band starts
+/// from the current disparities. Its random permutations of labels come from
+/// its own generator, initialized from \a seed, so that they do not depend on
+/// the order in which concurrent bands draw random numbers.
+void Match::SolveTile(int y0, int y1, bool fixBorders, unsigned int seed) {
+    const int m = fixBorders? CENSUS_RADIUS: TILE_MARGIN;
+    const int b0=std::max(0,y0-m), b1=std::min(imSizeL.y,y1+m);
+    const bool color = (imLeft==0);
+    const int c = color? 3: 1;
+    GeneralImage L = color? (GeneralImage)imColorLeft: (GeneralImage)imLeft;
+    GeneralImage R = color? (GeneralImage)imColorRight: (GeneralImage)imRight;
+    L = crop_rows(L, b0, b1, c);
+    R = crop_rows(R, b0, b1, c);
+
+    Match band(L, R, color);
+    band.progress = 0;
+    band.deadline = deadline;
+    band.randomState = 0x9E3779B97F4A7C15ULL*(seed+1ULL); // Never 0
+    band.SetDispRange(dispMin, dispMax);
+    Parameters bandParams = params;
+    bandParams.memoryBudget = 0;
+    band.SetParameters(&bandParams);
+    const int w = imSizeL.x;
+    if(fixBorders) {
+        band.fixedTop = y0-b0;
+        band.fixedBottom = b1-y1;
+    }
+    for(int y=b0; y<b1; y++) // Fixed rows and initial disparities
+        std::copy(&imRef(d_left,0,y), &imRef(d_left,0,y)+w,
+                  &imRef(band.d_left,0,y-b0));
+    band.KZ2();
+    for(int y=y0; y<y1; y++)
+        std::copy(&imRef(band.d_left,0,y-b0), &imRef(band.d_left,0,y-b0)+w,
+                  &imRef(d_left,0,y));
+
+    imFree(L);
+    imFree(R);
+}
+
+/// Run the algorithm by bands of rows (see SolveTile), so that the memory of
+/// a band times the number of threads fits in params.memoryBudget. The
+/// images, the data term, the disparity map and the variables of the full
+/// image are not included in the budget (see image_bytes_per_pixel).
+void Match::RunTiles() {
+    const double t0 = wall_time();
+    const int c = imLeft? 1: 3;
+    const size_t bytesRow = imSizeL.x*
+        band_bytes_per_pixel(params, c, dispMax-dispMin+1);
+    const size_t budget = (size_t)params.memoryBudget << 20;
+    int nThreads = 1;
+#ifdef _OPENMP
+    nThreads = omp_get_max_threads();
+#endif
+    int rows=0; // Rows of a band, excluding margins
+    for(; nThreads>=1; nThreads--) { // Avoid bands thinner than margins
+        size_t r = std::min(budget/nThreads/bytesRow,
+                            (size_t)(imSizeL.y+2*TILE_MARGIN));
+        rows = (int)r - 2*TILE_MARGIN;
+        if(rows>=2*TILE_MARGIN || nThreads==1)
+            break;
+    }
+    if(rows<1) {
+        std::cerr << "Memory budget too small, need at least "
+                  << (((2*TILE_MARGIN+1)*bytesRow)>>20)+1 << "MB" << std::endl;
+        exit(1);
+    }
+    const int nBands = (imSizeL.y+rows-1)/rows;
+    if(progress) {
+        std::ostringstream s;
+        s << "      " << nBands << " bands of at most "
+          << (imSizeL.y+nBands-1)/nBands << " rows, "
+          << nThreads << " threads, full image "
+          << (((size_t)imSizeL.x*imSizeL.y*
+               image_bytes_per_pixel(params,c))>>20)+1 << "MB";
+        progress->info(s.str());
+    }
+
+    std::vector<unsigned int> seeds(nBands); // Drawn in order of bands
+    for(int i=0; i<nBands; i++)
+        seeds[i] = (unsigned int)rand();
+
+    for(int parity=0; parity<2; parity++) {
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic) num_threads(nThreads)
+#endif
+        for(int i=parity; i<nBands; i+=2) {
+            const int y0=i*imSizeL.y/nBands, y1=(i+1)*imSizeL.y/nBands;
+            if(past_deadline()) // Rows remain occluded
+                continue;
+            SolveTile(y0, y1, parity==1, seeds[i]);
+            if(! progress)
+                continue;
+            std::ostringstream s;
+            s << "Rows " << y0 << '-' << y1-1
+              << " t=" << (int)(1000*(wall_time()-t0)) << "ms";
+#ifdef _OPENMP
+#pragma omp critical
+#endif
+            progress->info(s.str());
+        }
+    }
+
+    E = ComputeEnergy();
+    if(progress) {
+        std::ostringstream s;
+        s << "E=" << E;
+        progress->info(s.str());
+    }
+}